@@ -19,24 +19,24 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <deque>
 
 #include "collector.h"
 #include "uri.h"
 #include "tunnel.h"
 #include "dlna_filter.h"
+#include "media_cache.h"
 
 #include "debugprintf.h"
 
-static std::string make_key(std::string host, std::string port) {
-    return host + std::string(":") + port;
-}
-
-static std::string make_key(std::string host, uint16_t port) {
-    return host + std::string(":") + std::to_string(port);
+//Hosts of different sites may use the same address. Prefix with the site.
+std::string collector::make_key(tunnel * tn, std::string host, std::string port) {
+    return std::to_string(m_sites[tn]) + std::string("/") + host + std::string(":") + port;
 }
 
 collector::collector(std::string local_ip):
-    m_local_ip{local_ip} {
+    m_local_ip{local_ip},
+    m_share_backlog{HTTP_SHARE_BACKLOG} {
     debugprintf("Using local IP %s", m_local_ip.data());
 };
 
@@ -44,8 +44,65 @@ collector::~collector()
 {};
 
 void collector::use_tunnel(tunnel* tn) {
-    m_tn = tn;
-    open_ssdp();
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_lock);
+        m_sites[tn] = m_next_site++;
+    }
+    open_ssdp(tn);
+}
+
+// Site is gone. Tell the local clients and forget about its hosts.
+void collector::drop_tunnel(tunnel* tn) {
+    std::lock_guard<std::recursive_mutex> lock(m_lock);
+    for(auto host = hosts.begin(); host != hosts.end();) {
+        if(host->second->tn == tn) {
+            for(auto& message: host->second->messages) {
+                std::string forward = m_ssdp.createNotify(std::string("ssdp:byebye"), &(message.peer),
+                                      host->second->tunnel_host, host->second->tunnel_port);
+                send_local(forward);
+            }
+            handle_lose_host(host->first);
+            host = hosts.erase(host);
+        } else {
+            host ++;
+        }
+    }
+    m_sites.erase(tn);
+}
+
+void collector::use_local_ip(std::string local_ip) {
+    std::lock_guard<std::recursive_mutex> lock(m_lock);
+    if(m_local_ip.empty()) {
+        debugprintf("Using local IP %s", local_ip.data());
+        m_local_ip = local_ip;
+    }
+}
+
+// Hosts found from now on keep media they stream in this cache
+void collector::use_media_cache(std::shared_ptr<media_cache> media) {
+    std::lock_guard<std::recursive_mutex> lock(m_lock);
+    m_media = media;
+}
+
+// Hosts found from now on keep that many bytes of a shared response for clients that join late
+void collector::use_share_backlog(size_t bytes) {
+    std::lock_guard<std::recursive_mutex> lock(m_lock);
+    m_share_backlog = bytes;
+}
+
+void collector::send_local(const std::string& message, struct sockaddr_in * addr) {
+    if(m_local_ssdp == 0)
+        return;
+    struct sockaddr_in mcast;
+    if(addr == nullptr) {
+        memset(&mcast, 0, sizeof(struct sockaddr_in));
+        mcast.sin_family=AF_INET;
+        mcast.sin_port=htons(1900);
+        mcast.sin_addr.s_addr=inet_addr("239.255.255.250");
+        addr = &mcast;
+    }
+    int m =sendto(m_local_ssdp, message.data(), message.size(), 0, (struct sockaddr *)addr, sizeof(struct sockaddr_in));
+    debugprintf("n==%d, size=%ld",m, message.size());
 }
 
 void collector::use_px(socketmultiplex* local_px) {
@@ -53,72 +110,65 @@ void collector::use_px(socketmultiplex* local_px) {
     open_local_ssdp();
 }
 
-void collector::handle_answer_message(ssdp_peer * peer) {
+void collector::handle_answer_message(tunnel * tn, ssdp_peer * peer) {
     Uri loc = Uri::Parse(peer->LOCATION.data());
-    std::string key = make_key(loc.Host, loc.Port);
+    std::string key = make_key(tn, loc.Host, loc.Port);
     //Check if already in map
     auto dlnahost = hosts.find(key);
     if(dlnahost == hosts.end()) {
         debugprintf("Found new host %s", key.data());
-        dlna_host host;
-        host.host = loc.Host;
-        host.port = atoi(loc.Port.data());
-        host.messages.push_back({*peer});
+        std::shared_ptr<dlna_host> host = std::make_shared<dlna_host>();
+        host->host = loc.Host;
+        host->port = atoi(loc.Port.data());
+        host->tn = tn;
+        host->seen = time(nullptr);
+        host->messages.push_back({*peer});
         hosts.insert({key, host});
         handle_new_host(key);
     } else {
-        for(auto message : dlnahost->second.messages) {
+        dlnahost->second->seen = time(nullptr);
+        for(auto message : dlnahost->second->messages) {
             if(message.peer == *peer) {
                 debugprintf("Drop message. Already there.");
                 return;
             }
         }
-        dlnahost->second.messages.push_back({*peer});
+        dlnahost->second->messages.push_back({*peer});
     }
     dlnahost = hosts.find(key);
     if(dlnahost != hosts.end()) {
-        std::string forward = m_ssdp.createNotify(std::string("ssdp:alive"),peer,dlnahost->second.tunnel_host,
-                              dlnahost->second.tunnel_port );
+        std::string forward = m_ssdp.createNotify(std::string("ssdp:alive"),peer,dlnahost->second->tunnel_host,
+                              dlnahost->second->tunnel_port );
         debugprintf("Forward alive : %s", forward.data());
-        struct sockaddr_in addr;
-        memset(&addr, 0, sizeof(struct sockaddr_in));
-        addr.sin_family=AF_INET;
-        addr.sin_port=htons(1900);
-        addr.sin_addr.s_addr=inet_addr("239.255.255.250");
-        int m =sendto(m_local_ssdp, forward.data(), forward.size(), 0, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
+        send_local(forward);
     }
 };
 
-void collector::handle_notify_message(ssdp_peer * peer) {
+void collector::handle_notify_message(tunnel * tn, ssdp_peer * peer) {
     //What does the peer want us to say?
     if(peer->NTS.compare(std::string("ssdp:alive")) == 0) {
         debugprintf("Alive");
-        handle_answer_message(peer);
+        handle_answer_message(tn, peer);
         //Alive message
     } else if(peer->NTS.compare(std::string("ssdp:byebye")) == 0) {
         debugprintf("BYEBYE");
         //ByeBye messages don't tell location. so we need to find the service per message.
         for(auto& host: hosts) {
-            if(!host.second.messages.empty()) {
-                host.second.messages.erase(std::remove_if(host.second.messages.begin(),
-                host.second.messages.end(), [this, host, peer] (dlna_message& message) {
+            if((host.second->tn == tn) && !host.second->messages.empty()) {
+                host.second->messages.erase(std::remove_if(host.second->messages.begin(),
+                host.second->messages.end(), [this, host, peer] (dlna_message& message) {
                     if(message.peer == *peer) {
                         debugprintf("Byebye message.");
-                        std::string forward = m_ssdp.createNotify(std::string("ssdp:byebye"),peer, host.second.tunnel_host,
-                                              host.second.tunnel_port);
+                        std::string forward = m_ssdp.createNotify(std::string("ssdp:byebye"),peer,
+                                              host.second->tunnel_host, host.second->tunnel_port);
                         debugprintf("Forward byebye: %s", forward.data());
-                        struct sockaddr_in addr;
-                        memset(&addr, 0, sizeof(struct sockaddr_in));
-                        addr.sin_family=AF_INET;
-                        addr.sin_port=htons(1900);
-                        addr.sin_addr.s_addr=inet_addr("239.255.255.250");
-                        int m =sendto(m_local_ssdp, forward.data(), forward.size(), 0, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
+                        send_local(forward);
                         return true;
                     }
                     return false;
-                }), host.second.messages.end());
+                }), host.second->messages.end());
                 //remove if no messages left.
-                if(host.second.messages.empty()) {
+                if(host.second->messages.empty()) {
                     debugprintf("Byebye host: %s", host.first.data());
                     handle_lose_host(host.first);
                     hosts.erase(host.first);
@@ -134,8 +184,9 @@ void collector::handle_notify_message(ssdp_peer * peer) {
     }
 }
 
-void collector::add_message(char * message, uint32_t message_size) {
+void collector::add_message(tunnel * tn, char * message, uint32_t message_size) {
     ssdp_peer peer;
+    std::lock_guard<std::recursive_mutex> lock(m_lock);
     switch(m_ssdp.parse_message(message, message_size, &peer)) {
     case    SSDP_TYPE_UNKNOWN:
         debugprintf("Drop UNKOWN SSDP message");
@@ -145,35 +196,34 @@ void collector::add_message(char * message, uint32_t message_size) {
         break;
     case     SSDP_TYPE_ANSWER:
         debugprintf("ANSWER SSDP message");
-        handle_answer_message(&peer);
+        handle_answer_message(tn, &peer);
         break;
     case    SSDP_TYPE_NOTIFY:
         debugprintf("NOTIFY SSDP message %s", peer.raw.data());
-        handle_notify_message(&peer);
+        handle_notify_message(tn, &peer);
         break;
     }
     for(auto h: hosts) {
-        debugprintf("%s:%d:%d -> %ld",h.second.host.data(), h.second.port, h.second.tunnel_port, h.second.messages.size());
+        debugprintf("%s:%d:%d -> %ld",h.second->host.data(), h.second->port, h.second->tunnel_port,
+                    h.second->messages.size());
     }
 }
 
 void collector::handle_local_search_message(ssdp_peer * peer, struct sockaddr_in * addr) {
     debugprintf("Search for %s", peer->ST.data());
     for(auto h : hosts) {
-        for(auto peer: h.second.messages) {
+        for(auto peer: h.second->messages) {
             std::string message;
-            message = m_ssdp.createAnswer(&(peer.peer),h.second.tunnel_host, h.second.tunnel_port);
+            message = m_ssdp.createAnswer(&(peer.peer),h.second->tunnel_host, h.second->tunnel_port);
             debugprintf("-->> %s", message.data());
-            if(m_local_ssdp != 0) {
-                int m =sendto(m_local_ssdp, message.data(), message.size(), 0, (struct sockaddr *)addr, sizeof(struct sockaddr_in));
-                debugprintf("n==%d, size=%ld",m, message.size());
-            }
+            send_local(message, addr);
         }
     }
 }
 
 void collector::add_local_message(char * message, uint32_t message_size, struct sockaddr_in * addr) {
     ssdp_peer peer;
+    std::lock_guard<std::recursive_mutex> lock(m_lock);
     switch(m_ssdp.parse_message(message, message_size, &peer)) {
     case    SSDP_TYPE_UNKNOWN:
         debugprintf("Drop UNKOWN local SSDP message");
@@ -190,16 +240,17 @@ void collector::add_local_message(char * message, uint32_t message_size, struct
         break;
     }
     for(auto h: hosts) {
-        debugprintf("%s:%d:%d -> %ld",h.second.host.data(), h.second.port, h.second.tunnel_port, h.second.messages.size());
+        debugprintf("%s:%d:%d -> %ld",h.second->host.data(), h.second->port, h.second->tunnel_port,
+                    h.second->messages.size());
     }
 }
 
-void collector::open_ssdp () {
-    if(m_tn == nullptr) {
+void collector::open_ssdp (tunnel * tn) {
+    if(tn == nullptr) {
         errorprintf("Need to call use_tunnel() first wit working tunnel");
         return;
     }
-    m_tn->open_udp_mcast("239.255.255.250", 1900, [this](mplex * mpx, uint32_t channel) {
+    tn->open_udp_mcast("239.255.255.250", 1900, [this, tn](mplex * mpx, uint32_t channel) {
         char data[] =
             "M-SEARCH * HTTP/1.1\r\n"
             "HOST: 239.255.255.250:1900\r\n"
@@ -212,11 +263,11 @@ void collector::open_ssdp () {
         frame.payload_size=sprintf((char *)frame.payload.raw, "%s", data);
         mpx->send_data(channel, &frame);
 
-        mpx->add_channel_listener(channel,[this] (mplex * mpx, mplex_frame * frame) {
+        mpx->add_channel_listener(channel,[this, tn] (mplex * mpx, mplex_frame * frame) {
             if(frame == nullptr)
                 return false;
             frame->payload.raw[frame->payload_size -1] = 0;
-            add_message((char*)frame->payload.raw, frame->payload_size);
+            add_message(tn, (char*)frame->payload.raw, frame->payload_size);
             return true;
         });
         return true;
@@ -259,50 +310,197 @@ void collector::handle_new_host(std::string key) {
         errorprintf("Unable to find new host %s", key.data());
         return;
     }
-    host->second.tunnel_host = m_local_ip;
-    host->second.tunnel_port = m_tn->get_local_port();
+    tunnel * tn = host->second->tn;
+    host->second->media = m_media;
+    host->second->share_backlog = m_share_backlog;
+    host->second->tunnel_host = m_local_ip;
+    host->second->tunnel_port = tn->get_local_port();
     //Remember the control port, so we don't start the tunnel a second time
-    host->second.ports.insert({host->second.port, host->second.tunnel_port});
-    debugprintf("port forwarding for %s on %d", key.data(), host->second.tunnel_port);
-    m_tn->forward_port(host->second.tunnel_host.data(), host->second.tunnel_port, host->second.host.data(),
-                       host->second.port,
-                       [this, key](tunnel* tn, int socket, uint32_t channel, std::shared_ptr<tunnel_filter>& send_filter,
+    host->second->ports.insert({host->second->port, host->second->tunnel_port});
+    host->second->ports_version ++;
+    debugprintf("port forwarding for %s on %d", key.data(), host->second->tunnel_port);
+    tn->forward_port(host->second->tunnel_host.data(), host->second->tunnel_port, host->second->host.data(),
+                       host->second->port,
+                       [this, key](tunnel* tn, int socket, std::shared_ptr<tunnel_filter>& send_filter,
     std::shared_ptr<tunnel_filter>& receive_filter) {
+        std::lock_guard<std::recursive_mutex> lock(m_lock);
         auto host = hosts.find(key);
         if(host == hosts.end()) {
             errorprintf("Unable to find new host %s", key.data());
             return;
         }
         std::function<void(uint16_t)> on_additional_port = [this, key](uint16_t port) {
+            forward_additional_port(key, port);
+        };
+        std::shared_ptr<http_requests> requests = std::make_shared<http_requests>();
+        std::shared_ptr<dlna_filter> send = std::make_shared<dlna_filter>(host->second,on_additional_port);
+        std::shared_ptr<dlna_filter> receive = std::make_shared<dlna_filter>(host->second,on_additional_port);
+        send->track_requests(requests);
+        receive->track_requests(requests);
+        send_filter = send;
+        receive_filter = receive;
+        debugprintf("port forwarding established for %s on %d", key.data(), host->second->tunnel_port);
+    }, [this, key](uint16_t local_port) {
+        return forward_idle(key, local_port);
+    });
+    Uri location = Uri::Parse(host->second->messages.front().peer.LOCATION);
+    if(!location.Path.empty())
+        prefetch(key, location.Path + location.QueryString);
+}
+
+// Ports a host mentions in its messages besides the control port get a forward of their own
+void collector::forward_additional_port(std::string key, uint16_t port) {
+    std::lock_guard<std::recursive_mutex> lock(m_lock);
+    auto host = hosts.find(key);
+    if(host == hosts.end()) {
+        errorprintf("Unable to find new host %s", key.data());
+        return;
+    }
+    auto port_forward = host->second->ports.find(port);
+    if(port_forward == host->second->ports.end()) {
+        dlna_host& h = *host->second;
+        uint16_t tunnel_port=h.tn->get_local_port();
+        h.ports.insert({port, tunnel_port});
+        h.ports_version ++;
+        debugprintf("opening tunnel: %s:%d->%s:%d", h.tunnel_host.data(), tunnel_port, h.host.data(), port);
+        h.tn->forward_port(h.tunnel_host.data(), tunnel_port, h.host.data(), port,
+                           [this, key, port](tunnel* tn, int socket, std::shared_ptr<tunnel_filter>& send_filter,
+        std::shared_ptr<tunnel_filter>& receive_filter) {
+            std::lock_guard<std::recursive_mutex> lock(m_lock);
             auto host = hosts.find(key);
             if(host == hosts.end()) {
-                errorprintf("Unable to find new host %s", key.data());
+                errorprintf("Unable to find host %s", key.data());
                 return;
             }
-            auto port_forward = host->second.ports.find(port);
-            if(port_forward == host->second.ports.end()) {
-                auto& h = host->second;
-                uint16_t tunnel_port=m_tn->get_local_port();
-                h.ports.insert({port, tunnel_port});
-                debugprintf("opening tunnel: %s:%d->%s:%d", h.tunnel_host.data(), tunnel_port, h.host.data(), port);
-                m_tn->forward_port(h.tunnel_host.data(), tunnel_port, h.host.data(), port,
-                                   [this, key](tunnel* tn, int socket, uint32_t channel, std::shared_ptr<tunnel_filter>& send_filter,
-                std::shared_ptr<tunnel_filter>& receive_filter) {
-                    auto host = hosts.find(key);
-                    if(host == hosts.end()) {
-                        errorprintf("Unable to find host %s", key.data());
-                        return;
-                    }
-                    auto& h = host->second;
-                    debugprintf("opened tunnel: %s:%d->%s:%d", h.host.data(), h.port, h.tunnel_host.data(), h.tunnel_port);
-                    //Here we could install channel filters of the addiional data channels. But we don't. This
-                    //does not seem to be neccesary as only data is transferred here.
-                });
+            dlna_host& h = *host->second;
+            debugprintf("opened tunnel: %s:%d->%s:%d", h.host.data(), h.port, h.tunnel_host.data(), h.tunnel_port);
+            //Mostly media and album art. The filter lets clients asking for the same at once share one
+            //response, and keeps media in the cache if there is one.
+            std::function<void(uint16_t)> on_additional_port = [this, key](uint16_t port) {
+                forward_additional_port(key, port);
+            };
+            std::shared_ptr<http_requests> requests = std::make_shared<http_requests>();
+            std::shared_ptr<dlna_filter> send = std::make_shared<dlna_filter>(host->second, on_additional_port,
+                                                port);
+            std::shared_ptr<dlna_filter> receive = std::make_shared<dlna_filter>(host->second, on_additional_port,
+                                                   port);
+            send->track_requests(requests);
+            receive->track_requests(requests);
+            send_filter = send;
+            receive_filter = receive;
+        }, [this, key](uint16_t local_port) {
+            return forward_idle(key, local_port);
+        });
+    }
+}
+
+// Announced lifetime of a host, from CACHE-CONTROL of its messages
+static time_t host_max_age(const dlna_host & h) {
+    time_t result = 1800;
+    for(auto& message: h.messages) {
+        const std::string& cache = message.peer.CACHE_CONTROL;
+        size_t max_age = cache.find("max-age=");
+        if(max_age != std::string::npos)
+            result = atoi(cache.data() + max_age + 8);
+    }
+    return result;
+}
+
+// Nobody used a forward of the host for a while. Additional ports are forwarded again once a message
+// mentions them. The control port only goes with the host, when it was not announced for its max-age.
+bool collector::forward_idle(std::string key, uint16_t local_port) {
+    std::lock_guard<std::recursive_mutex> lock(m_lock);
+    auto host = hosts.find(key);
+    if(host == hosts.end())
+        return true;
+    dlna_host& h = *host->second;
+    if(local_port != h.tunnel_port) {
+        for(auto port = h.ports.begin(); port != h.ports.end(); port ++) {
+            if(port->second == local_port) {
+                h.ports.erase(port);
+                break;
             }
-        };
-        send_filter.reset(new dlna_filter(&(host->second),on_additional_port));
-        receive_filter.reset(new dlna_filter(&(host->second),on_additional_port));
-        debugprintf("port forwarding established for %s on %d", key.data(), host->second.tunnel_port);
+        }
+        h.ports_version ++;
+        //Cached responses may have URLs with the old port
+        h.browse.reset();
+        h.documents.reset();
+        return true;
+    }
+    if(time(nullptr) - h.seen < host_max_age(h))
+        return false;
+    debugprintf("Host %s not announced anymore", key.data());
+    for(auto& message: h.messages) {
+        std::string forward = m_ssdp.createNotify(std::string("ssdp:byebye"), &(message.peer), h.tunnel_host,
+                              h.tunnel_port);
+        send_local(forward);
+    }
+    handle_lose_host(key);
+    hosts.erase(host);
+    return true;
+}
+
+// Fetch the device description, and then the SCPDs it names, before a client asks. The
+// responses run through the same filter as the client's would and stay in the host's
+// document cache. One channel, one request after the other.
+void collector::prefetch(std::string key, std::string path) {
+    auto host = hosts.find(key);
+    if(host == hosts.end())
+        return;
+    dlna_host& h = *host->second;
+    std::shared_ptr<dlna_filter> receive = std::make_shared<dlna_filter>(host->second, [this, key](uint16_t port) {
+        forward_additional_port(key, port);
+    });
+    std::shared_ptr<http_requests> requests = std::make_shared<http_requests>();
+    receive->track_requests(requests);
+    std::shared_ptr<document_cache> documents = h.documents;
+    std::shared_ptr<std::deque<std::string>> paths = std::make_shared<std::deque<std::string>>();
+    std::string real_host = h.host + std::string(":") + std::to_string(h.port);
+    documents->set_max_age(host_max_age(h));
+    documents->expect(path);
+    paths->push_back(path);
+    //Output only goes to the cache
+    std::shared_ptr<std::string> scratch = std::make_shared<std::string>();
+    std::shared_ptr<tunnel_sink> discard = std::make_shared<tunnel_sink>([scratch](size_t & size) {
+        scratch->resize(size);
+        return scratch->data();
+    }, [](size_t size, size_t used) {
+        return true;
+    });
+    std::function<bool(mplex * mpx, uint32_t channel)> next = [requests, paths, real_host](mplex * mpx,
+    uint32_t channel) {
+        if(paths->empty())
+            return false;
+        debugprintf("Prefetch %s", paths->front().data());
+        std::string request = std::string("GET ") + paths->front() + std::string(" HTTP/1.1\r\nHOST: ") + real_host
+                              + std::string("\r\n\r\n");
+        requests->push_back(http_request{"GET", std::string("GET ") + paths->front()});
+        paths->pop_front();
+        mpx->send_data(channel, request.data(), request.size());
+        return true;
+    };
+    h.tn->open_remote(h.host.data(), h.port, [receive, requests, documents, paths, path, discard, next](mplex * mpx,
+    uint32_t channel) {
+        if((channel <= 0) || !next(mpx, channel))
+            return false;
+        mpx->add_channel_listener(channel, [receive, requests, documents, paths, path, discard, next](mplex * mpx,
+        mplex_frame * frame) {
+            if(frame == nullptr)
+                return false;
+            if(!receive->process((const char*) frame->payload.raw, frame->payload_size, *discard))
+                return false;
+            if(!requests->empty() || !receive->between_messages())
+                return true;
+            //Response is complete. The description tells which SCPDs to get next.
+            for(auto& service: documents->services(path)) {
+                if(documents->known(service))
+                    continue;
+                documents->expect(service);
+                paths->push_back(service);
+            }
+            return next(mpx, frame->channel);
+        });
+        return true;
     });
 }
 
@@ -312,7 +510,8 @@ void collector::handle_lose_host(std::string key) {
         errorprintf("Unable to find died host %s", key.data());
         return;
     }
-    for(auto port: host->second.ports) {
-        m_tn->rewoke_forward(port.first);
+    //first: remote port, second: our local port
+    for(auto port: host->second->ports) {
+        host->second->tn->rewoke_forward(port.second);
     }
 }
@@ -21,9 +21,17 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
+#include <mutex>
 #include "ssdp.h"
 #include "tunnel.h"
 
+class port_rewriter;
+class browse_cache;
+class document_cache;
+class fetch_sharing;
+class media_cache;
+
 struct dlna_message {
     //timestanp
     ssdp_peer peer;
@@ -34,8 +42,17 @@ struct dlna_host {
     uint16_t port{0};
     std::string tunnel_host{};
     uint16_t tunnel_port{0};
+    tunnel * tn{nullptr}; //site the host was found at
     std::vector<dlna_message> messages{};
     std::map<uint16_t, uint16_t> ports{};
+    size_t ports_version{0}; //changes whenever ports do
+    time_t seen{0}; //last announcement
+    std::shared_ptr<port_rewriter> rewriter{}; //compiled from host and ports, see dlna_filter
+    std::shared_ptr<browse_cache> browse{};
+    std::shared_ptr<document_cache> documents{};
+    std::shared_ptr<fetch_sharing> shares{};
+    size_t share_backlog{0}; //bytes of a shared response kept for late clients, see http_share
+    std::shared_ptr<media_cache> media{}; //shared by all hosts, if enabled
 };
 
 class collector {
@@ -43,25 +60,40 @@ public:
     collector(std::string local_ip);
     ~collector();
 
-    void add_message(char * message, uint32_t message_size);
+    void add_message(tunnel * tn, char * message, uint32_t message_size);
     void add_local_message(char * message, uint32_t message_size, struct sockaddr_in * addr);
     void use_tunnel(tunnel* tn);
+    void drop_tunnel(tunnel* tn);
     void use_px(socketmultiplex* local_px);
+    void use_local_ip(std::string local_ip);
+    void use_media_cache(std::shared_ptr<media_cache> media);
+    void use_share_backlog(size_t bytes);
 
 private:
+    std::string make_key(tunnel * tn, std::string host, std::string port);
     void handle_local_search_message(ssdp_peer * peer, struct sockaddr_in *addr);
-    void handle_answer_message(ssdp_peer * peer);
-    void handle_notify_message(ssdp_peer * peer);
+    void handle_answer_message(tunnel * tn, ssdp_peer * peer);
+    void handle_notify_message(tunnel * tn, ssdp_peer * peer);
     void handle_new_host(std::string key);
     void handle_lose_host(std::string key);
-    void open_ssdp ();
+    void forward_additional_port(std::string key, uint16_t port);
+    bool forward_idle(std::string key, uint16_t local_port);
+    void prefetch(std::string key, std::string path);
+    void send_local(const std::string& message, struct sockaddr_in * addr=nullptr);
+    void open_ssdp (tunnel * tn);
     void open_local_ssdp ();
-    std::map<std::string, dlna_host> hosts{};
+    //Hosts of all sites. Sites run in their own threads, so everything touching hosts holds m_lock.
+    //Filters of open connections share their host, it may be forgotten here while they still run.
+    std::map<std::string, std::shared_ptr<dlna_host>> hosts{};
+    std::recursive_mutex m_lock{};
+    std::map<tunnel*, int> m_sites{};
+    int m_next_site{0};
     ssdp m_ssdp{};
-    tunnel * m_tn{nullptr};
     socketmultiplex * m_local_px;
     int m_local_ssdp{0};
     std::string m_local_ip{};
+    std::shared_ptr<media_cache> m_media{};
+    size_t m_share_backlog;
 
 };
 
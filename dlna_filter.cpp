@@ -17,44 +17,544 @@
 */
 
 
+#include <charconv>
 #include <functional>
-#include <regex>
 #include <string>
+#include <string_view>
+#include <time.h>
 
 #include "stringtoken.h"
 #include "dlna_filter.h"
 #include "collector.h"
+#include "uri.h"
 #include "debugprintf.h"
 
-static void find_ports(const std::string& a, const std::string& b, std::function<void(uint16_t port)> f) {
-    std::regex re(b+std::string(":[0-9]+"), std::regex_constants::icase);
-    std::sregex_iterator next(a.begin(), a.end(), re);
-    std::sregex_iterator end;
-    while (next != end) {
-        std::smatch match = *next;
-        size_t found = match.str().find_last_of(":");
-        f(atoi(match.str().substr(found+1).data()));
-        next++;
+port_rewriter::port_rewriter(const dlna_host & host) {
+    for(char c: host.host)
+        m_host += ascii_lower(c);
+    //Knuth-Morris-Pratt table, so we never have to step back in the data
+    m_fail.resize(m_host.size(), 0);
+    size_t k = 0;
+    for(size_t a = 1; a < m_host.size(); a++) {
+        while((k > 0) && (m_host[a] != m_host[k]))
+            k = m_fail[k - 1];
+        if(m_host[a] == m_host[k])
+            k++;
+        m_fail[a] = k;
     }
+    update(host);
 }
 
-dlna_filter::dlna_filter(dlna_host * host, std::function<void(uint16_t port)> f): http {host->host + std::string(":") + std::to_string(host->port)},
+void port_rewriter::update(const dlna_host & host) {
+    if(host.ports_version == m_version)
+        return;
+    m_replace.clear();
+    for(auto port: host.ports) {
+        m_replace[port.first] = host.tunnel_host + std::string(":") + std::to_string(port.second);
+    }
+    m_version = host.ports_version;
+}
+
+std::string port_rewriter::rewrite(const std::string & data, const dlna_host & host,
+                                   std::function<void(uint16_t port)> f) {
+    std::string result{};
+    if(m_host.empty())
+        return data;
+    result.reserve(data.size());
+    size_t copied = 0;
+    size_t state = 0;
+    for(size_t pos = 0; pos < data.size(); pos++) {
+        char c = ascii_lower(data[pos]);
+        while((state > 0) && (c != m_host[state]))
+            state = m_fail[state - 1];
+        if(c == m_host[state])
+            state++;
+        if(state < m_host.size())
+            continue;
+        state = m_fail[state - 1];
+        //host found, is there a port?
+        size_t end = pos + 1;
+        if((end >= data.size()) || (data[end] != ':'))
+            continue;
+        uint32_t port = 0;
+        for(end++; (end < data.size()) && isdigit((unsigned char) data[end]) && (port <= 0xffff); end++)
+            port = port * 10 + (data[end] - '0');
+        if((end == pos + 2) || (port > 0xffff))
+            continue;
+        //Tell about it first, it may become forwarded right now
+        f(port);
+        update(host);
+        auto replace = m_replace.find(port);
+        if(replace == m_replace.end())
+            continue;
+        result.append(data, copied, pos + 1 - m_host.size() - copied);
+        result += replace->second;
+        copied = end;
+        pos = end - 1;
+        state = 0;
+    }
+    result.append(data, copied, std::string::npos);
+    return result;
+}
+
+//Could data starting at pos turn into "host:port" once more data arrives?
+static bool partial_match(const std::string& data, size_t pos, const std::string& host) {
+    size_t a;
+    for(a = 0; a < host.size(); a++) {
+        if(pos + a >= data.size())
+            return true;
+        if(ascii_lower(data[pos + a]) != ascii_lower(host[a]))
+            return false;
+    }
+    pos += a;
+    if(pos >= data.size())
+        return true;
+    if(data[pos] != ':')
+        return false;
+    for(pos++; pos < data.size(); pos++) {
+        if(!isdigit((unsigned char) data[pos]))
+            return false;
+    }
+    return true;
+}
+
+#define BROWSE_CACHE_TIME 300 //seconds
+#define BROWSE_CACHE_SIZE (8 * 1024 * 1024)
+
+//Text of the first <name> element
+static std::string_view element(std::string_view data, std::string_view name) {
+    std::string open = std::string("<") + std::string(name) + std::string(">");
+    size_t start = data.find(open);
+    if(start == std::string_view::npos)
+        return std::string_view{};
+    start += open.size();
+    size_t end = data.find('<', start);
+    if(end == std::string_view::npos)
+        return std::string_view{};
+    return data.substr(start, end - start);
+}
+
+//Value of a header line not parsed by http
+static std::string_view header_field(std::string_view header, std::string_view name) {
+    size_t pos = 0;
+    while(pos < header.size()) {
+        size_t end = header.find('\n', pos);
+        if(end == std::string_view::npos)
+            end = header.size();
+        std::string_view line = header.substr(pos, end - pos);
+        if((line.size() > name.size()) && (line[name.size()] == ':') && iequals(line.substr(0, name.size()), name)) {
+            line.remove_prefix(name.size() + 1);
+            while(!line.empty() && ((line.front() == ' ') || (line.front() == '"')))
+                line.remove_prefix(1);
+            while(!line.empty() && ((line.back() == ' ') || (line.back() == '"') || (line.back() == '\r')))
+                line.remove_suffix(1);
+            return line;
+        }
+        pos = end + 1;
+    }
+    return std::string_view{};
+}
+
+//Replaces a header line not parsed by http, or adds it
+static void set_header_field(std::string & header, std::string_view name, const std::string & value) {
+    size_t pos = 0;
+    while(pos < header.size()) {
+        size_t end = header.find('\n', pos);
+        if(end == std::string::npos)
+            end = header.size();
+        std::string_view line(header.data() + pos, end - pos);
+        if((line.size() > name.size()) && (line[name.size()] == ':') && iequals(line.substr(0, name.size()), name)) {
+            header.replace(pos, end - pos, std::string(name) + std::string(": ") + value + std::string("\r"));
+            return;
+        }
+        pos = end + 1;
+    }
+    header.append(name).append(": ").append(value).append("\r\n");
+}
+
+//Same request from different clients: whitespace between elements does not count
+static std::string normalize(std::string_view body) {
+    std::string result{};
+    result.reserve(body.size());
+    bool space = false;
+    for(char c: body) {
+        if(isspace((unsigned char) c)) {
+            space = true;
+            continue;
+        }
+        if(space && !result.empty() && (result.back() != '>') && (c != '<'))
+            result += ' ';
+        space = false;
+        result += c;
+    }
+    return result;
+}
+
+bool browse_cache::find(const std::string & key, std::string & response) {
+    auto e = m_entries.find(key);
+    if(e == m_entries.end())
+        return false;
+    if(time(nullptr) - e->second.stored > BROWSE_CACHE_TIME) {
+        erase(e);
+        return false;
+    }
+    response = e->second.response;
+    return true;
+}
+
+void browse_cache::store(const std::string & key, const std::string & response) {
+    if(response.size() > BROWSE_CACHE_SIZE / 4)
+        return;
+    entry stored;
+    stored.object_id = element(key, "ObjectID");
+    stored.update_id = element(response, "UpdateID");
+    stored.response = response;
+    stored.stored = time(nullptr);
+    for(auto e = m_entries.begin(); e != m_entries.end();) {
+        auto next = std::next(e);
+        //Container changed since these were stored
+        if((e->first == key) || ((e->second.object_id == stored.object_id) && (e->second.update_id != stored.update_id)))
+            erase(e);
+        e = next;
+    }
+    while(m_size + response.size() > BROWSE_CACHE_SIZE) {
+        auto oldest = m_entries.begin();
+        for(auto e = m_entries.begin(); e != m_entries.end(); e++) {
+            if(e->second.stored < oldest->second.stored)
+                oldest = e;
+        }
+        erase(oldest);
+    }
+    m_size += response.size();
+    m_entries[key] = std::move(stored);
+}
+
+//SystemUpdateID as answered to GetSystemUpdateID or sent in an event
+void browse_cache::observe(std::string_view data) {
+    std::string_view id{};
+    if(data.find("GetSystemUpdateIDResponse") != std::string_view::npos)
+        id = element(data, "Id");
+    else
+        id = element(data, "SystemUpdateID");
+    if(id.empty() || (id == m_system_update_id))
+        return;
+    if(!m_system_update_id.empty()) {
+        debugprintf("SystemUpdateID %.*s, dropping %ld browse results", (int) id.size(), id.data(), m_entries.size());
+        m_entries.clear();
+        m_size = 0;
+    }
+    m_system_update_id = id;
+}
+
+void browse_cache::erase(std::map<std::string, entry>::iterator e) {
+    m_size -= e->second.response.size();
+    m_entries.erase(e);
+}
+
+void document_cache::expect(const std::string & path) {
+    m_entries.insert({path, entry{}});
+}
+
+bool document_cache::known(const std::string & path) const {
+    return m_entries.find(path) != m_entries.end();
+}
+
+bool document_cache::find(const std::string & path, std::string & response) {
+    auto e = m_entries.find(path);
+    if((e == m_entries.end()) || e->second.response.empty() || (time(nullptr) >= e->second.expires))
+        return false;
+    response = e->second.response;
+    return true;
+}
+
+void document_cache::store(const std::string & path, const std::string & response) {
+    entry& e = m_entries[path];
+    e.response = response;
+    e.expires = time(nullptr) + m_max_age;
+}
+
+void document_cache::set_max_age(time_t max_age) {
+    m_max_age = max_age;
+}
+
+//Paths of the SCPD documents a stored device description names
+std::vector<std::string> document_cache::services(const std::string & path) const {
+    std::vector<std::string> result{};
+    auto e = m_entries.find(path);
+    if(e == m_entries.end())
+        return result;
+    std::string_view data(e->second.response);
+    std::string base = path.substr(0, path.rfind('/') + 1);
+    size_t pos = 0;
+    while((pos = data.find("<SCPDURL>", pos)) != std::string_view::npos) {
+        std::string url(element(data.substr(pos), "SCPDURL"));
+        pos += 9;
+        if(url.find("://") != std::string::npos) {
+            Uri uri = Uri::Parse(url);
+            url = uri.Path + uri.QueryString;
+        } else if(url.compare(0, 1, "/") != 0) {
+            url = base + url;
+        }
+        if(!url.empty())
+            result.push_back(url);
+    }
+    return result;
+}
+
+fetch_sharing::fetch_sharing(size_t max_backlog):
+    m_max_backlog{max_backlog} {
+}
+
+bool fetch_sharing::join(const std::string & key, const std::shared_ptr<tunnel_sink> & reply) {
+    auto fetch = m_fetches.find(key);
+    if(fetch == m_fetches.end())
+        return false;
+    std::shared_ptr<http_share> share = fetch->second.lock();
+    return share && share->join(reply);
+}
+
+std::shared_ptr<http_share> fetch_sharing::lead(const std::string & key) {
+    //Responses that are done are gone
+    for(auto fetch = m_fetches.begin(); fetch != m_fetches.end();) {
+        if(fetch->second.expired())
+            fetch = m_fetches.erase(fetch);
+        else
+            fetch ++;
+    }
+    std::shared_ptr<http_share> share = std::make_shared<http_share>(m_max_backlog);
+    m_fetches[key] = share;
+    return share;
+}
+
+dlna_filter::dlna_filter(std::shared_ptr<dlna_host> host, std::function<void(uint16_t port)> f,
+                         uint16_t port):
+    http {host->host + std::string(":") + std::to_string((port == 0) ? host->port : port)},
     m_host{host},
+    m_port{(port == 0) ? host->port : port},
+    m_media{host->media},
     m_f{f} {
+    if(!m_host->browse)
+        m_host->browse = std::make_shared<browse_cache>();
+    m_browse = m_host->browse;
+    if(!m_host->documents)
+        m_host->documents = std::make_shared<document_cache>();
+    m_documents = m_host->documents;
+    if(!m_host->shares)
+        m_host->shares = std::make_shared<fetch_sharing>(m_host->share_backlog);
+    m_shares = m_host->shares;
 }
 
 dlna_filter::~dlna_filter() {
 }
 
 std::string dlna_filter::filter_http(const std::string & http_data) {
-    find_ports(http_data, std::string(m_host->host), [this](uint16_t port) {
+    m_browse->observe(http_data);
+    if(!m_host->rewriter)
+        m_host->rewriter = std::make_shared<port_rewriter>(*m_host);
+    return m_host->rewriter->rewrite(http_data, *m_host, [this](uint16_t port) {
         m_f(port);
     });
-    std::string temp = http_data;
-    for(auto port: m_host->ports) {
-        temp = do_replace_case(temp, m_host->host + std::string(":") + std::to_string(port.first),
-                               m_host->tunnel_host + std::string(":") + std::to_string(port.second));
+}
+
+
+size_t dlna_filter::filter_safe_length(const std::string & http_data) {
+    //host + ":" + 5 digits port + one more to see the port ended
+    size_t window = m_host->host.size() + 7;
+    size_t start = (http_data.size() > window) ? http_data.size() - window : 0;
+    for(size_t pos = start; pos < http_data.size(); pos++) {
+        if(partial_match(http_data, pos, m_host->host))
+            return pos;
+    }
+    return http_data.size();
+}
+
+//Descriptions and Browse results are answered from the caches, a miss tags the request so its
+//response is kept
+bool dlna_filter::answer_request(std::string & header, const std::string & body, http_request & request,
+                                 const std::shared_ptr<tunnel_sink> & reply) {
+    std::string & tag = request.tag;
+    std::string response{};
+    if(header.compare(0, 4, "GET ") == 0) {
+        std::string path(header, 4, header.find(' ', 4) - 4);
+        if((m_port == m_host->port) && m_documents->known(path)) {
+            tag = std::string("GET ") + path;
+            if(reply && m_documents->find(path, response)) {
+                reply->write(response.data(), response.size());
+                return true;
+            }
+        } else if(answer_media(header, path, tag, reply.get())) {
+            return true;
+        } else if(tag.compare(0, 13, "MEDIA-APPEND ") == 0) {
+            //Only the rest is asked for, nothing another client could use
+            return false;
+        }
+        return share_fetch(header, path, request, reply);
+    }
+    if(header.compare(0, 5, "POST ") != 0)
+        return false;
+    std::string_view action = header_field(header, "SOAPACTION");
+    if((action.size() < 7) || (action.compare(action.size() - 7, 7, "#Browse") != 0))
+        return false;
+    tag = m_host->host + std::string(":") + std::to_string(m_port) + std::string(" ") + std::string(action)
+          + std::string(" ") + normalize(body);
+    if(!reply || !m_browse->find(tag, response))
+        return false;
+    reply->write(response.data(), response.size());
+    return true;
+}
+
+// The same GET of another client is on its way already: wait for its response instead of
+// asking again. Otherwise this one is shared with those that come while it is on its way.
+bool dlna_filter::share_fetch(const std::string & header, const std::string & path, http_request & request,
+                              const std::shared_ptr<tunnel_sink> & reply) {
+    if(!header_field(header, "AUTHORIZATION").empty() || icontains(header_field(header, "CACHE-CONTROL"), "no-cache")
+            || icontains(header_field(header, "PRAGMA"), "no-cache"))
+        return false;
+    std::string key = m_host->host + std::string(":") + std::to_string(m_port) + path + std::string(" ")
+                      + std::string(header_field(header, "RANGE")) + std::string(" ")
+                      + std::string(header_field(header, "ACCEPT-ENCODING"));
+    if(m_shares->join(key, reply)) {
+        debugprintf("Share response to GET %s", path.data());
+        return true;
+    }
+    request.share = m_shares->lead(key);
+    return false;
+}
+
+// Media requests are answered from the cache as far as it has the range. If only the start is
+// there, that is sent right away and just the rest is asked for.
+bool dlna_filter::answer_media(std::string & header, const std::string & path, std::string & tag,
+                               tunnel_sink * reply) {
+    if(!m_media)
+        return false;
+    std::string url = m_host->host + std::string(":") + std::to_string(m_port) + path;
+    tag = std::string("MEDIA ") + url;
+    std::shared_ptr<media_file> file = m_media->find(url);
+    if((reply == nullptr) || !file)
+        return false;
+    size_t length = file->length();
+    size_t first = 0;
+    size_t last = length - 1;
+    std::string_view range = header_field(header, "RANGE");
+    if(!range.empty()) {
+        //Single byte ranges only: bytes=first-[last] or bytes=-suffix
+        size_t dash = range.find('-');
+        if((range.compare(0, 6, "bytes=") != 0) || (range.find(',') != std::string_view::npos)
+                || (dash == std::string_view::npos))
+            return false;
+        std::string_view from = range.substr(6, dash - 6);
+        std::string_view to = range.substr(dash + 1);
+        size_t value = 0;
+        if(from.empty()) {
+            std::from_chars(to.data(), to.data() + to.size(), value);
+            if((value == 0) || (value > length))
+                return false;
+            first = length - value;
+        } else {
+            std::from_chars(from.data(), from.data() + from.size(), first);
+            if(!to.empty() && (std::from_chars(to.data(), to.data() + to.size(), value).ec == std::errc()))
+                last = (value < last) ? value : last;
+        }
+        if((first >= length) || (last < first))
+            return false;
     }
-    return temp;
+    size_t have = m_media->cached(file, first);
+    if(have == 0)
+        return false;
+    size_t wanted = last + 1 - first;
+    if(have > wanted)
+        have = wanted;
+    std::string response = range.empty() ? std::string("HTTP/1.1 200 OK\r\n") :
+                           std::string("HTTP/1.1 206 Partial Content\r\n");
+    response += file->header;
+    if(!range.empty())
+        response += std::string("CONTENT-RANGE: bytes ") + std::to_string(first) + std::string("-")
+                    + std::to_string(last) + std::string("/") + std::to_string(length) + std::string("\r\n");
+    response += std::string("CONTENT-LENGTH: ") + std::to_string(wanted) + std::string("\r\n\r\n");
+    debugprintf("%s: %ld of %ld bytes from cache", url.data(), have, wanted);
+    if(!reply->write(response.data(), response.size()) || !reply->send_file(file->fd(), first, have, file))
+        return true;
+    if(have == wanted)
+        return true;
+    //Remote sends the rest, its header is dropped
+    set_header_field(header, "RANGE", std::string("bytes=") + std::to_string(first + have) + std::string("-")
+                     + std::to_string(last));
+    tag = std::string("MEDIA-APPEND ") + std::to_string(first + have) + std::string(" ") + url;
+    return false;
 }
 
+http_content dlna_filter::begin_content(const std::string & tag, int status, std::string_view header,
+                                        std::string_view content_type, std::string_view content_length, bool plain) {
+    m_media_file.reset();
+    bool append = (tag.compare(0, 13, "MEDIA-APPEND ") == 0);
+    if(!append && (tag.compare(0, 6, "MEDIA ") != 0))
+        return (status == 200) ? HTTP_CONTENT_CAPTURE : HTTP_CONTENT_PASS;
+    if(!m_media)
+        return append ? HTTP_CONTENT_FAIL : HTTP_CONTENT_PASS;
+    std::string validator = std::string(header_field(header, "ETAG")) + std::string("|")
+                            + std::string(header_field(header, "LAST-MODIFIED"));
+    //bytes first-last/length
+    size_t first = 0;
+    size_t length = 0;
+    if(status == 206) {
+        std::string_view range = header_field(header, "CONTENT-RANGE");
+        size_t slash = range.find('/');
+        if((range.compare(0, 6, "bytes ") != 0) || (slash == std::string_view::npos))
+            return append ? HTTP_CONTENT_FAIL : HTTP_CONTENT_PASS;
+        std::from_chars(range.data() + 6, range.data() + range.size(), first);
+        std::from_chars(range.data() + slash + 1, range.data() + range.size(), length);
+    } else if(status == 200) {
+        std::from_chars(content_length.data(), content_length.data() + content_length.size(), length);
+    }
+    if(append) {
+        //Has to continue exactly what was sent from the cache
+        size_t space = tag.find(' ', 13);
+        size_t expected = 0;
+        std::from_chars(tag.data() + 13, tag.data() + space, expected);
+        std::shared_ptr<media_file> file = m_media->find(tag.substr(space + 1));
+        if(!plain || (status != 206) || !file || (file->validator != validator) || (file->length() != length)
+                || (first != expected)) {
+            errorprintf("Remote rest of %s does not fit, close connection", tag.data() + space + 1);
+            return HTTP_CONTENT_FAIL;
+        }
+        m_media_file = file;
+        m_media_offset = first;
+        return HTTP_CONTENT_APPEND;
+    }
+    if(!plain || (length == 0) || ((status != 200) && (status != 206)))
+        return HTTP_CONTENT_PASS;
+    //Header lines worth repeating when answering from the cache
+    std::string lines{};
+    if(!content_type.empty())
+        lines += std::string("CONTENT-TYPE: ") + std::string(content_type) + std::string("\r\n");
+    size_t pos = header.find('\n');
+    while((pos != std::string_view::npos) && (pos + 1 < header.size())) {
+        size_t end = header.find('\n', pos + 1);
+        std::string_view line = header.substr(pos + 1, (end == std::string_view::npos) ? std::string_view::npos : end - pos);
+        pos = end;
+        std::string_view name = line.substr(0, line.find(':'));
+        if(iequals(name, "CONTENT-RANGE") || iequals(name, "DATE") || iequals(name, "CONNECTION")
+                || iequals(name, "KEEP-ALIVE"))
+            continue;
+        lines += std::string(line);
+    }
+    m_media_file = m_media->open(tag.substr(6), validator, length, lines);
+    if(!m_media_file)
+        return HTTP_CONTENT_PASS;
+    m_media_offset = first;
+    return HTTP_CONTENT_STORE;
+}
+
+void dlna_filter::store_content(const std::string & tag, const char * data, const size_t data_length) {
+    if(!m_media_file)
+        return;
+    m_media->store(m_media_file, m_media_offset, data, data_length);
+    m_media_offset += data_length;
+}
+
+void dlna_filter::store_response(const std::string & tag, const std::string & response) {
+    if(tag.compare(0, 4, "GET ") == 0)
+        m_documents->store(tag.substr(4), response);
+    else
+        m_browse->store(tag, response);
+}
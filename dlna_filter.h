@@ -20,20 +20,113 @@
 #define __DLNA_FILTER_H
 
 #include <functional>
+#include <map>
 #include <string>
+#include <string_view>
+#include <time.h>
+#include <vector>
 
 #include "http.h"
 #include "collector.h"
+#include "media_cache.h"
 
 
+/* Finds "host:port" in a message (ignoring case) and replaces the ones we forward with
+ * "tunnel_host:tunnel_port". Runs in one pass over the data no matter how many ports are
+ * forwarded. Compiled once per host, the replacements are redone when ports change. */
+class port_rewriter {
+public:
+    port_rewriter(const dlna_host & host);
+
+    void update(const dlna_host & host);
+    std::string rewrite(const std::string & data, const dlna_host & host, std::function<void(uint16_t port)> f);
+private:
+    std::string m_host;
+    std::vector<size_t> m_fail;
+    size_t m_version{0};
+    std::map<uint16_t, std::string> m_replace{};
+};
+
+/* Rewritten responses to ContentDirectory Browse requests of one host. A new SystemUpdateID
+ * drops all of them, a new UpdateID of a container the ones browsing it. As not every client
+ * asks for those, entries also expire after a while. */
+class browse_cache {
+public:
+    bool find(const std::string & key, std::string & response);
+    void store(const std::string & key, const std::string & response);
+    void observe(std::string_view data);
+private:
+    struct entry {
+        std::string object_id{};
+        std::string update_id{};
+        std::string response{};
+        time_t stored{0};
+    };
+    void erase(std::map<std::string, entry>::iterator e);
+    std::map<std::string, entry> m_entries{};
+    std::string m_system_update_id{};
+    size_t m_size{0};
+};
+
+/* Device and service descriptions of one host, fetched as soon as the host is found. Served
+ * from memory until the max-age of its announcement runs out, then refreshed by the next
+ * request for them. */
+class document_cache {
+public:
+    void expect(const std::string & path);
+    bool known(const std::string & path) const;
+    bool find(const std::string & path, std::string & response);
+    void store(const std::string & path, const std::string & response);
+    void set_max_age(time_t max_age);
+    std::vector<std::string> services(const std::string & path) const;
+private:
+    struct entry {
+        std::string response{};
+        time_t expires{0};
+    };
+    std::map<std::string, entry> m_entries{};
+    time_t m_max_age{1800};
+};
+
+/* GET requests to one host whose responses are on their way. The same request of another
+ * client shares the response instead of crossing the tunnel once more. */
+class fetch_sharing {
+public:
+    //max_backlog: see http_share
+    fetch_sharing(size_t max_backlog);
+    bool join(const std::string & key, const std::shared_ptr<tunnel_sink> & reply);
+    std::shared_ptr<http_share> lead(const std::string & key);
+private:
+    std::map<std::string, std::weak_ptr<http_share>> m_fetches{};
+    size_t m_max_backlog;
+};
+
 class dlna_filter : public http {
 public:
-    dlna_filter(dlna_host * host, std::function<void(uint16_t port)> f);
+    //port: the host's port this filter is for, if not the control port
+    dlna_filter(std::shared_ptr<dlna_host> host, std::function<void(uint16_t port)> f, uint16_t port=0);
     virtual ~dlna_filter();
 
 private:
     std::string filter_http(const std::string & http_data) override;
-    dlna_host* m_host;
+    size_t filter_safe_length(const std::string & http_data) override;
+    bool answer_request(std::string & header, const std::string & body, http_request & request,
+                        const std::shared_ptr<tunnel_sink> & reply) override;
+    bool answer_media(std::string & header, const std::string & path, std::string & tag, tunnel_sink * reply);
+    bool share_fetch(const std::string & header, const std::string & path, http_request & request,
+                     const std::shared_ptr<tunnel_sink> & reply);
+    http_content begin_content(const std::string & tag, int status, std::string_view header,
+                               std::string_view content_type, std::string_view content_length, bool plain) override;
+    void store_content(const std::string & tag, const char * data, const size_t data_length) override;
+    void store_response(const std::string & tag, const std::string & response) override;
+    std::shared_ptr<dlna_host> m_host; //kept alive, the collector may forget it meanwhile
+    uint16_t m_port;
+    std::shared_ptr<browse_cache> m_browse;
+    std::shared_ptr<document_cache> m_documents;
+    std::shared_ptr<fetch_sharing> m_shares;
+    std::shared_ptr<media_cache> m_media;
+    std::shared_ptr<media_file> m_media_file{}; //response being stored
+    size_t m_media_offset{0};
     std::function<void(uint16_t port)> m_f;
 };
 
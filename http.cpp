@@ -17,16 +17,41 @@
 */
 
 
+#include <charconv>
 #include <functional>
 #include "http.h"
 #include "stringtoken.h"
 
 #include "debugprintf.h"
 
-#define HTTP_NL std::string("\r\n")
+#define HTTP_NL std::string_view("\r\n")
+#define HTTP_HEADER_RESERVE 2048
+#define HTTP_VALUES_RESERVE 256
+#define HTTP_OUTPUT_THRESHOLD (64 * 1024) //Send collected output once it gets this big
+
+//Case insensitive FNV-1a. Duplicate case labels would not compile, so the headers we know never collide.
+static constexpr uint32_t header_hash(std::string_view name) {
+    uint32_t hash = 2166136261u;
+    for(char c: name) {
+        if((c >= 'a') && (c <= 'z'))
+            c -= ('a' - 'A');
+        hash = (hash ^ (uint8_t) c) * 16777619u;
+    }
+    return hash;
+}
+
+static std::string_view trim(std::string_view text) {
+    while(!text.empty() && ((text.front() == ' ') || (text.front() == '\t')))
+        text.remove_prefix(1);
+    while(!text.empty() && ((text.back() == ' ') || (text.back() == '\t')))
+        text.remove_suffix(1);
+    return text;
+}
 
 http::http( std::string realHost ):
     m_realHost{realHost} {
+    m_header_data.reserve(HTTP_HEADER_RESERVE);
+    m_header_values.reserve(HTTP_VALUES_RESERVE);
     debugprintf("created");
 }
 
@@ -35,28 +60,86 @@ http::~http() {
 }
 
 bool http::parse_header_line(const char * line, size_t line_length) {
-    if(parse_token("HOST", line, line_length, &(m_header.HOST)))
-        return true;
-    if(parse_token("CONTENT-LENGTH", line, line_length, &(m_header.CONTENT_LENGTH)))
-        return true;
-    if(parse_token("CONTENT-TYPE", line, line_length, &(m_header.CONTENT_TYPE)))
-        return true;
-    if(parse_token("TRANSFER-ENCODING", line, line_length, &(m_header.TRANSFER_ENCODING)))
-        return true;
-    return false;
+    std::string_view text(line, line_length);
+    size_t colon = text.find(':');
+    if(colon == std::string_view::npos)
+        return false;
+    std::string_view name = trim(text.substr(0, colon));
+    http_value * found{nullptr};
+    switch(header_hash(name)) {
+    case header_hash("HOST"):
+        found = iequals(name, "HOST") ? &m_header.HOST : nullptr;
+        break;
+    case header_hash("CONTENT-LENGTH"):
+        found = iequals(name, "CONTENT-LENGTH") ? &m_header.CONTENT_LENGTH : nullptr;
+        break;
+    case header_hash("CONTENT-TYPE"):
+        found = iequals(name, "CONTENT-TYPE") ? &m_header.CONTENT_TYPE : nullptr;
+        break;
+    case header_hash("TRANSFER-ENCODING"):
+        found = iequals(name, "TRANSFER-ENCODING") ? &m_header.TRANSFER_ENCODING : nullptr;
+        break;
+    default:
+        break;
+    }
+    if(found == nullptr)
+        return false;
+    std::string_view content = trim(text.substr(colon + 1));
+    found->offset = m_header_values.size();
+    found->length = content.size();
+    m_header_values.append(content.data(), content.size());
+    return true;
+}
+
+std::string_view http::value(const http_value & value) const {
+    return std::string_view(m_header_values.data() + value.offset, value.length);
+}
+
+void http::reset_header() {
+    m_header = http_header{};
+    m_bodyless = false;
+    m_header_values.clear();
+    m_header_data.clear();
+}
+
+void http::complete_http_header(std::string_view content_length) {
+    m_header_data.append("HOST: ").append(m_realHost).append(HTTP_NL);
+    if(m_bodyless) {
+        //Describes the body the request would have got, keep it as it is
+        if(m_header.TRANSFER_ENCODING.length > 0)
+            m_header_data.append("TRANSFER-ENCODING: ").append(value(m_header.TRANSFER_ENCODING)).append(HTTP_NL);
+        else if(!content_length.empty())
+            m_header_data.append("CONTENT-LENGTH: ").append(content_length).append(HTTP_NL);
+    } else if(m_chunked || m_streaming)
+        m_header_data.append("TRANSFER-ENCODING: chunked").append(HTTP_NL);
+    else if(!content_length.empty())
+        m_header_data.append("CONTENT-LENGTH: ").append(content_length).append(HTTP_NL);
+    if(m_header.CONTENT_TYPE.length > 0)
+        m_header_data.append("CONTENT-TYPE: ").append(value(m_header.CONTENT_TYPE)).append(HTTP_NL);
+    m_header_data.append(HTTP_NL);
+}
+
+bool http::write_header(std::string_view content_length,
+                        tunnel_sink & f) {
+    debugprintf("Write ot header");
+    complete_http_header(content_length);
+    bool result = f(m_header_data.data(), m_header_data.size());
+    reset_header();
+    return result;
 }
 
-void http::complete_http_header() {
-    m_header_data += (std::string("HOST: ") + m_realHost + HTTP_NL);
-    if(!m_chunked)
-        m_header_data += (std::string("CONTENT-LENGTH: ") + m_header.CONTENT_LENGTH + HTTP_NL);
-    else
-        m_header_data += (std::string("TRANSFER-ENCODING: chunked") + HTTP_NL);
-    m_header_data += (std::string("CONTENT-TYPE: ") + m_header.CONTENT_TYPE + HTTP_NL);
-    m_header_data += HTTP_NL;
+// Response is out completely
+void http::end_content() {
+    if(m_content == HTTP_CONTENT_CAPTURE)
+        store_response(m_capture_tag, m_capture);
+    if(m_share)
+        m_share->finish();
+    m_share.reset();
+    m_content = HTTP_CONTENT_PASS;
+    m_capture.clear();
 }
 
-bool http::flush_and_reset(std::function<bool(const char * data, const size_t data_length)> f) {
+bool http::flush_and_reset(tunnel_sink & f) {
     debugprintf("Flush remaining");
     if(m_state == HTTP_STATE_HEADER) {
         m_header_data += m_rest;
@@ -65,10 +148,13 @@ bool http::flush_and_reset(std::function<bool(const char * data, const size_t da
         }
 
     }
-    if(m_state == HTTP_STATE_HTML) {
-        m_header.CONTENT_LENGTH = std::to_string(m_http_data.size());
-        complete_http_header();
-        if(!f(m_header_data.data(), m_header_data.size())) {
+    if((m_state == HTTP_STATE_HTML) && (m_streaming || m_chunked)) {
+        //Header is out already. Terminate the chunked body.
+        if(!stream_filter(nullptr, 0, true, f)) {
+            return false;
+        }
+    } else if(m_state == HTTP_STATE_HTML) {
+        if(!write_header(std::to_string(m_http_data.size()), f)) {
             return false;
         }
         if(!f(m_http_data.data(), m_http_data.size())) {
@@ -76,55 +162,77 @@ bool http::flush_and_reset(std::function<bool(const char * data, const size_t da
         }
     }
     m_state = HTTP_STATE_HEADER;
-    m_header=http_header{};
-    m_header_data.clear();
+    reset_header();
     m_http_data.clear();
+    m_stream_rest.clear();
+    m_stream_out.clear();
     m_chunked = false;
+    m_streaming = false;
+    m_content = HTTP_CONTENT_PASS;
+    m_capture.clear();
+    m_share.reset();
     return true;
 }
 
 bool http::process_header(const char * data, const size_t data_length, size_t * processed,
-                          std::function<bool(const char * data, const size_t data_length)> f) {
+                          tunnel_sink & f) {
     debugprintf("Process header, %ld left", data_length);
     size_t pos{0};
     size_t n{0};
     do {
-        char * buffer{nullptr};
-        int buffer_size{0};
+        std::string_view line{};
         bool have_newline{false};
-        n = read_line( &buffer, &buffer_size, data + pos, data_length - pos, &have_newline);
+        n = read_line_view( &line, data + pos, data_length - pos, &have_newline);
         if(n > 0) {
-            if(buffer != nullptr) {
-                m_rest += std::string(buffer);
+            //Lines that arrived in one piece are parsed right where they are
+            if(!have_newline || !m_rest.empty()) {
+                m_rest.append(line.data(), line.size());
+                line = m_rest;
             }
             if(have_newline) {
-                if(m_rest.size() == 0) {
-                    debugprintf("Got end of header. type: %s", m_header.CONTENT_TYPE.data());
+                if(line.size() == 0) {
+                    std::string_view type = value(m_header.CONTENT_TYPE);
+                    debugprintf("Got end of header. type: %.*s", (int) type.size(), type.data());
                     m_state = HTTP_STATE_CONTENT;
-                    if(icontains(m_header.CONTENT_TYPE, std::string("text/html")))
+                    if(icontains(type, "text/html"))
                         m_state = HTTP_STATE_HTML;
-                    else if(icontains(m_header.CONTENT_TYPE, std::string("text/xml")))
+                    else if(icontains(type, "text/xml"))
                         m_state = HTTP_STATE_HTML;
 
-                    if(icontains(m_header.TRANSFER_ENCODING, std::string("chunked"))) {
+                    if(icontains(value(m_header.TRANSFER_ENCODING), "chunked")) {
                         debugprintf("Found chunked HTML format");
                         m_chunked = true;
                     }
 
                     m_http_data.clear();
-                    m_missing = atoi(m_header.CONTENT_LENGTH.data());
+                    std::string_view length = value(m_header.CONTENT_LENGTH);
+                    m_missing = 0;
+                    std::from_chars(length.data(), length.data() + length.size(), m_missing);
+                    //HTTP/1.1 responses we rewrite are sent chunked while they arrive. No need to
+                    //buffer all of it just to learn the new length. Requests stay as they are,
+                    //servers often don't take chunked requests.
+                    if((m_state == HTTP_STATE_HTML) && !m_chunked && (m_missing > 0)
+                            && (m_header_data.compare(0, 8, "HTTP/1.1") == 0)) {
+                        m_streaming = true;
+                    }
+                    if(!expect_body()) {
+                        debugprintf("Response without body");
+                        m_state = HTTP_STATE_CONTENT;
+                        m_chunked = false;
+                        m_streaming = false;
+                        m_bodyless = true;
+                        m_missing = 0;
+                    }
                 } else {
-                    if(!parse_header_line(m_rest.data(), m_rest.size())) {
+                    if(!parse_header_line(line.data(), line.size())) {
                         //Add unknown header lines directly to buffer
-                        m_header_data += m_rest;
-                        m_header_data += HTTP_NL;
+                        m_header_data.append(line).append(HTTP_NL);
                     }
                 }
                 //Clear rest
-                m_rest = std::string{};
+                m_rest.clear();
             }
             pos +=n;
-            free(buffer);
         }
     } while ((n > 0) && (pos < data_length) && m_state == HTTP_STATE_HEADER);
 
@@ -132,68 +240,71 @@ bool http::process_header(const char * data, const size_t data_length, size_t *
     return true;
 }
 
+// Body of the current message, no more. Returns to HTTP_STATE_HEADER once the body is complete.
 bool http::process_plain(const char * data, const size_t data_length, size_t * processed,
-                         std::function<bool(const char * data, const size_t data_length)> f) {
+                         tunnel_sink & f) {
     debugprintf("Process plain, %ld left", data_length);
-    size_t pos{0};
+    size_t send = data_length;
+    if (send > m_missing) {
+        send = m_missing;
+    }
     if(m_state == HTTP_STATE_CONTENT) {
-        //debugprintf("Missing %ld bytes", m_missing);
-        if(!m_header_data.empty()) {
-            debugprintf("Write ot header");
-            complete_http_header();
-            if (!f(m_header_data.data(), m_header_data.size())) {
-                return false;
-            }
-
-            m_header = http_header{};
-            m_header_data.clear();
+        if(m_content == HTTP_CONTENT_FAIL)
+            return false;
+        if(!m_header_data.empty() && (m_missing == 0) && answer()) {
+            m_state = HTTP_STATE_HEADER;
+            *processed = 0;
+            return true;
         }
-        if(pos < data_length) {
-            size_t send = data_length - pos;
-            if (send > m_missing) {
-                send = m_missing;
-            }
-            if(!f(data + pos, send)) {
+        if(!m_header_data.empty() && (m_content == HTTP_CONTENT_APPEND)) {
+            //Body continues one sent already
+            reset_header();
+        } else if(!m_header_data.empty()) {
+            if(!write_header(value(m_header.CONTENT_LENGTH), f)) {
                 return false;
             }
-            m_missing -= send;
-            pos +=send;
         }
+        if((send > 0) && !f(data, send)) {
+            return false;
+        }
+        if((send > 0) && ((m_content == HTTP_CONTENT_STORE) || (m_content == HTTP_CONTENT_APPEND)))
+            store_content(m_capture_tag, data, send);
+        m_missing -= send;
         if(m_missing == 0) {
             m_state = HTTP_STATE_HEADER;
-            if(pos <data_length) {
-                debugprintf("Still something left. Call ourself");
-                http::process(data + pos, data_length -pos, f);
-            }
         }
-    }
-    if(m_state == HTTP_STATE_HTML) {
-        //debugprintf("Missing %ld bytes", m_missing);
-        size_t available = data_length - pos;
-        if(available > 0) {
-            int a;
-            for(a = 0; (a < available) && (a < m_missing); a++) {
-                m_http_data.push_back(*(data + (pos + a)));
+    } else if(m_streaming) {
+        if(!m_header_data.empty()) {
+            if(!write_header(value(m_header.CONTENT_LENGTH), f)) {
+                return false;
             }
-            m_missing -= a;
-            available -= a;
-            pos += a;
-
+        }
+        m_missing -= send;
+        if(!stream_filter(data, send, m_missing == 0, f)) {
+            return false;
         }
+        if(m_missing == 0) {
+            debugprintf ("done streaming data");
+            m_streaming = false;
+            m_state = HTTP_STATE_HEADER;
+        }
+    } else {
+        m_http_data.append(data, send);
+        m_missing -= send;
         if(m_missing == 0) {
             debugprintf ("done reading data");
+            if(answer()) {
+                m_state = HTTP_STATE_HEADER;
+                *processed = send;
+                return true;
+            }
             debugprintf("Filter HTTP data");
             m_http_data = filter_http(m_http_data);
             m_state = HTTP_STATE_HEADER;
 
-            m_header.CONTENT_LENGTH = std::to_string(m_http_data.size());
-            complete_http_header();
-            debugprintf("Write ot header");
-            if(!f(m_header_data.data(), m_header_data.size())) {
+            if(!write_header(std::to_string(m_http_data.size()), f)) {
                 return false;
             }
-            m_header = http_header{};
-            m_header_data.clear();
             debugprintf("Write out HTML data");
             if(!f(m_http_data.data(), m_http_data.size())) {
                 return false;
@@ -201,65 +312,57 @@ bool http::process_plain(const char * data, const size_t data_length, size_t * p
             m_http_data.clear();
         }
     }
-    *processed=pos;
+    *processed=send;
     return true;
 }
 
 bool http::process_chunked(const char * data, const size_t data_length, size_t * processed,
-                           std::function<bool(const char * data, const size_t data_length)> f) {
+                           tunnel_sink & f) {
     size_t pos=0;
     //Write out header if not done so. In chunked mode we always can do so.
     if(!m_header_data.empty()) {
-        debugprintf("Write ot header");
-        complete_http_header();
-        if (!f(m_header_data.data(), m_header_data.size())) {
+        if(!write_header(value(m_header.CONTENT_LENGTH), f)) {
             return false;
         }
-
-        m_header = http_header{};
-        m_header_data.clear();
     }
     do {
         if(m_chunk_missing == 0) {
             size_t n{0};
             //new chunk
-            char * buffer{nullptr};
-            int buffer_size{0};
+            std::string_view line{};
             bool have_newline{false};
-            n = read_line( &buffer, &buffer_size, data + pos, data_length - pos, &have_newline);
+            n = read_line_view( &line, data + pos, data_length - pos, &have_newline);
             if(n > 0) {
-                if(buffer != nullptr) {
-                    m_chunk_rest += std::string(buffer);
-                }
+                m_chunk_rest.append(line.data(), line.size());
                 if(have_newline) {
                     m_chunk_missing = strtol(m_chunk_rest.data(), NULL, 16);
                     debugprintf("m_chunk_missing %ld",m_chunk_missing);
                     m_chunk_missing += 2; // add closing newline
                     m_chunk_rest.clear();
                 }
-                free (buffer);
             }
             pos += n;
         } else {
-            size_t  n{0};
             size_t available = data_length - pos;
             if(available > m_chunk_missing) {
-                for(int a=0; a < m_chunk_missing; a++) {
-                    m_chunk_data.push_back((data+pos)[a]);
-                }
-                pos += m_chunk_missing;
-                m_chunk_missing = 0;
-            } else {
-                for(int a=0; a < available; a++) {
-                    m_chunk_data.push_back((data+pos)[a]);
-                }
-                pos += available;
-                m_chunk_missing -= available;
+                available = m_chunk_missing;
             }
-            if(m_chunk_missing == 0) {
-                if(m_state == HTTP_STATE_HTML) {
-                    m_chunk_data = filter_http(m_chunk_data);
+            m_chunk_data.append(data + pos, available);
+            pos += available;
+            m_chunk_missing -= available;
+            if((m_chunk_missing == 0) && (m_state == HTTP_STATE_HTML)) {
+                //Rewrite across chunk boundaries, a match may be split by the server.
+                bool final = (m_chunk_data.size() <= 2);
+                size_t length = final ? 0 : m_chunk_data.size() - 2;
+                if(!stream_filter(m_chunk_data.data(), length, final, f))
+                    return false;
+                if(final) {
+                    debugprintf("Found end of chunks");
+                    m_chunked=false;
+                    m_state=HTTP_STATE_HEADER;
                 }
+                m_chunk_data.clear();
+            } else if(m_chunk_missing == 0) {
                 char bf[100];
                 sprintf(bf, "%lX", m_chunk_data.size() -2);
                 std::string start = (bf);
@@ -281,52 +384,286 @@ bool http::process_chunked(const char * data, const size_t data_length, size_t *
     return true;
 }
 
-bool http::process(const char * data, const size_t data_length,
-                   std::function<bool(const char * data, const size_t data_length)> f) {
-    int pos{0};
-    int n{0};
-
+// One loop over the stages, for as many pipelined messages as there are in data.
+bool http::process_data(const char * data, const size_t data_length,
+                        tunnel_sink & f) {
     if(data_length == 0) {
         flush_and_reset(f);
         return false;
     }
 
-    if(m_state == HTTP_STATE_HEADER) {
-        size_t taken =0;
-        if(process_header(data+ pos, data_length-pos, &taken, f)) {
-            pos +=taken;
+    size_t pos{0};
+    do {
+        size_t taken{0};
+        http_state state = m_state;
+        bool result;
+        if(m_state == HTTP_STATE_HEADER) {
+            result = process_header(data + pos, data_length - pos, &taken, f);
+        } else if(m_chunked) {
+            result = process_chunked(data + pos, data_length - pos, &taken, f);
         } else {
-            return false;
+            result = process_plain(data + pos, data_length - pos, &taken, f);
         }
-    }
-    if (!m_chunked) {
-        size_t taken =0;
-        if(process_plain(data+ pos, data_length-pos, &taken, f)) {
-            pos +=taken;
-        } else {
+        if(!result) {
             return false;
         }
-
-    } else {
-        size_t taken =0;
-        if(process_chunked(data+ pos, data_length-pos, &taken, f)) {
-            pos +=taken;
-        } else {
-            return false;
+        pos += taken;
+        if((m_state == HTTP_STATE_HEADER) && (state != HTTP_STATE_HEADER))
+            end_content();
+        if((taken == 0) && (state == m_state)) {
+            //Waiting for more data
+            break;
         }
+    } while((pos < data_length) || body_pending());
+    return true;
+}
+
+void http::track_requests(std::shared_ptr<http_requests> requests) {
+    m_requests = requests;
+}
+
+void http::set_reply(std::shared_ptr<tunnel_sink> reply) {
+    m_reply = reply;
+}
+
+//Nothing of a message seen yet
+bool http::between_messages() const {
+    return (m_state == HTTP_STATE_HEADER) && m_header_data.empty() && m_rest.empty();
+}
+
+// Requests are remembered, so the response to a HEAD request is known to have no body. Same for
+// interim (1xx), 204 and 304 responses.
+bool http::expect_body() {
+    std::string_view first(m_header_data);
+    first = first.substr(0, first.find(HTTP_NL));
+    if(first.compare(0, 5, "HTTP/") != 0) {
+        if(m_requests)
+            m_requests->push_back(http_request{std::string(first.substr(0, first.find(' '))), {}});
+        return true;
+    }
+    size_t space = first.find(' ');
+    int status = 0;
+    if(space != std::string_view::npos)
+        std::from_chars(first.data() + space + 1, first.data() + first.size(), status);
+    if((status >= 100) && (status < 200)) {
+        //The final response is still to come
+        return false;
     }
-    if(pos < data_length) {
-        debugprintf("Still something left. Call ourself");
-        return http::process(data + pos, data_length - pos, f);
+    bool head = false;
+    m_capture_tag.clear();
+    m_share.reset();
+    if(m_requests && !m_requests->empty()) {
+        head = (m_requests->front().method == "HEAD");
+        m_capture_tag = std::move(m_requests->front().tag);
+        m_share = std::move(m_requests->front().share);
+        m_requests->pop_front();
     }
+    bool body = !head && (status != 204) && (status != 304);
+    m_content = HTTP_CONTENT_PASS;
+    m_capture.clear();
+    if(!m_capture_tag.empty()) {
+        bool plain = body && (m_state == HTTP_STATE_CONTENT) && !m_chunked;
+        m_content = begin_content(m_capture_tag, status, m_header_data, value(m_header.CONTENT_TYPE),
+                                  value(m_header.CONTENT_LENGTH), plain);
+    }
+    return body;
+}
+
+// Requests the filter answers itself never reach the remote. That is only done while no other
+// request waits for its response, answers have to keep the order of the requests.
+bool http::answer() {
+    if(!m_requests || m_requests->empty() || (m_header_data.compare(0, 5, "HTTP/") == 0))
+        return false;
+    std::shared_ptr<tunnel_sink> reply = (m_requests->size() == 1) ? m_reply : nullptr;
+    if(!answer_request(m_header_data, m_http_data, m_requests->back(), reply))
+        return false;
+    debugprintf("Answered request locally");
+    m_requests->pop_back();
+    reset_header();
+    m_http_data.clear();
     return true;
 }
 
+// Message body stage has something to do even without more data: the header is not out yet or
+// there is no body at all.
+bool http::body_pending() const {
+    if(m_state == HTTP_STATE_HEADER)
+        return false;
+    return !m_header_data.empty() || (!m_chunked && (m_missing == 0));
+}
+
+// Everything written during one call is collected and leaves as one piece, instead of one frame
+// for the header, one for each chunk size line and one for each chunk.
+bool http::process(const char * data, const size_t data_length, tunnel_sink & f) {
+    tunnel_sink output([this](size_t & size) {
+        size_t used = m_output.size();
+        m_output.resize(used + size);
+        return m_output.data() + used;
+    }, [this, &f](size_t size, size_t used) {
+        m_output.resize(m_output.size() - (size - used));
+        if(m_content == HTTP_CONTENT_CAPTURE)
+            m_capture.append(m_output.data() + m_output.size() - used, used);
+        if(m_share)
+            m_share->send(m_output.data() + m_output.size() - used, used);
+        if(m_output.size() >= HTTP_OUTPUT_THRESHOLD)
+            return flush_output(f);
+        return true;
+    });
+    bool result = process_data(data, data_length, output);
+    if(!m_stream_out.empty()) {
+        //Rewritten body so far, as one chunk
+        if(!write_chunk(m_stream_out, output))
+            result = false;
+        m_stream_out.clear();
+    }
+    if(!flush_output(f))
+        return false;
+    return result;
+}
+
+bool http::flush_output(tunnel_sink & f) {
+    bool result = f(m_output.data(), m_output.size());
+    m_output.clear();
+    return result;
+}
 
+//Body of a response we don't rewrite (media) needs no state machine once its header is out.
+size_t http::passthrough(const size_t data_length) {
+    if((m_state != HTTP_STATE_CONTENT) || m_chunked || (m_content != HTTP_CONTENT_PASS) || m_share
+            || !m_header_data.empty())
+        return 0;
+    size_t send = data_length;
+    if(send > m_missing)
+        send = m_missing;
+    m_missing -= send;
+    if(m_missing == 0)
+        m_state = HTTP_STATE_HEADER;
+    return send;
+}
 
+bool http::write_chunk(const std::string & chunk, tunnel_sink & f) {
+    //Empty chunk would end the body
+    if(chunk.empty())
+        return true;
+    char bf[100];
+    sprintf(bf, "%lX", chunk.size());
+    std::string start = (bf);
+    start += HTTP_NL;
+    if(!f(start.data(), start.size()))
+        return false;
+    if(!f(chunk.data(), chunk.size()))
+        return false;
+    return f(HTTP_NL.data(), HTTP_NL.size());
+}
+
+// Rewrite body data as it arrives and send it as chunks. Anything that might be the start of a
+// match is kept back until the next call.
+bool http::stream_filter(const char * data, const size_t data_length, bool final,
+                         tunnel_sink & f) {
+    if(data_length > 0)
+        m_stream_rest.append(data, data_length);
+    size_t safe = final ? m_stream_rest.size() : filter_safe_length(m_stream_rest);
+    if(safe > 0) {
+        m_stream_out += filter_http(m_stream_rest.substr(0, safe));
+        m_stream_rest.erase(0, safe);
+    }
+    //Small upstream chunks are sent on as bigger ones
+    if(final || (m_stream_out.size() >= HTTP_OUTPUT_THRESHOLD)) {
+        if(!write_chunk(m_stream_out, f))
+            return false;
+        m_stream_out.clear();
+    }
+    if(final) {
+        m_stream_rest.clear();
+        std::string end = std::string("0\r\n\r\n");
+        return f(end.data(), end.size());
+    }
+    return true;
+}
 
 std::string http::filter_http(const std::string & http_data) {
     return std::string(http_data);
 }
 
+size_t http::filter_safe_length(const std::string & http_data) {
+    return http_data.size();
+}
+
+bool http::answer_request(std::string & header, const std::string & body, http_request & request,
+                          const std::shared_ptr<tunnel_sink> & reply) {
+    return false;
+}
+
+http_content http::begin_content(const std::string & tag, int status, std::string_view header,
+                                 std::string_view content_type, std::string_view content_length, bool plain) {
+    return HTTP_CONTENT_PASS;
+}
 
+void http::store_content(const std::string & tag, const char * data, const size_t data_length) {
+}
+
+void http::store_response(const std::string & tag, const std::string & response) {
+}
+
+http_share::http_share(size_t max_backlog):
+    m_max_backlog{max_backlog} {
+}
+
+http_share::~http_share() {
+    if(m_finished)
+        return;
+    //Remote went away in the middle of the response
+    for(auto& waiter: m_waiters) {
+        std::shared_ptr<tunnel_sink> reply = waiter.lock();
+        if(reply)
+            reply->close();
+    }
+}
+
+bool http_share::join(const std::shared_ptr<tunnel_sink> & reply) {
+    if(!m_joinable || m_finished || !reply)
+        return false;
+    for(auto& segment: m_backlog) {
+        if(!reply->send_shared(segment))
+            return false;
+    }
+    reply->hold(true);
+    m_waiters.push_back(reply);
+    return true;
+}
+
+void http_share::send(const char * data, const size_t data_length) {
+    if(!m_joinable && m_waiters.empty())
+        return;
+    std::shared_ptr<const std::string> segment = std::make_shared<const std::string>(data, data_length);
+    if(m_joinable) {
+        if(m_backlog_size + data_length <= m_max_backlog) {
+            m_backlog.push_back(segment);
+            m_backlog_size += data_length;
+        } else {
+            m_joinable = false;
+            m_backlog.clear();
+            m_backlog_size = 0;
+        }
+    }
+    for(auto waiter = m_waiters.begin(); waiter != m_waiters.end();) {
+        std::shared_ptr<tunnel_sink> reply = waiter->lock();
+        if(!reply || !reply->send_shared(segment)) {
+            waiter = m_waiters.erase(waiter);
+            continue;
+        }
+        waiter ++;
+    }
+}
+
+void http_share::finish() {
+    m_finished = true;
+    for(auto& waiter: m_waiters) {
+        std::shared_ptr<tunnel_sink> reply = waiter.lock();
+        if(reply)
+            reply->hold(false);
+    }
+    m_waiters.clear();
+    m_backlog.clear();
+    m_backlog_size = 0;
+}
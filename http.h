@@ -19,54 +19,148 @@
 #ifndef __HTTP_H
 #define __HTTP_H
 
+#include <deque>
 #include <functional>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include "tunnel_filter.h"
 
+//Bytes of a shared response kept for clients that join late, unless set with --share-backlog
+#define HTTP_SHARE_BACKLOG (1024 * 1024)
+
 enum http_state {
     HTTP_STATE_HEADER,
     HTTP_STATE_CONTENT,
     HTTP_STATE_HTML
 };
 
+//What happens to the response to a tagged request
+enum http_content {
+    HTTP_CONTENT_PASS, //sent on, nothing else
+    HTTP_CONTENT_CAPTURE, //complete response goes to store_response() once it is out
+    HTTP_CONTENT_STORE, //body goes to store_content() while it passes
+    HTTP_CONTENT_APPEND, //same, but the header is dropped: the body continues one answered locally
+    HTTP_CONTENT_FAIL //can't be sent on, give up the connection
+};
+
+//Position of a header value inside the value arena of the message
+struct http_value {
+    uint32_t offset{0};
+    uint32_t length{0};
+};
+
 struct http_header {
-    std::string HOST{};
-    std::string CONTENT_TYPE{};
-    std::string CONTENT_LENGTH{};
-    std::string TRANSFER_ENCODING{};
+    http_value HOST{};
+    http_value CONTENT_TYPE{};
+    http_value CONTENT_LENGTH{};
+    http_value TRANSFER_ENCODING{};
+};
+
+/* Response to one request, handed to other local clients that asked for the same while it was
+ * on its way. Each piece is copied once into a segment all of them send from. Clients that
+ * come late get the segments that passed so far first, as long as they are no more than
+ * max_backlog bytes. Their sockets take no new requests until the response is complete, one
+ * that ends early closes them. */
+class http_share {
+public:
+    http_share(size_t max_backlog);
+    ~http_share();
+    bool join(const std::shared_ptr<tunnel_sink> & reply);
+    void send(const char * data, const size_t data_length);
+    void finish();
+private:
+    std::vector<std::shared_ptr<const std::string>> m_backlog{};
+    size_t m_backlog_size{0};
+    size_t m_max_backlog;
+    bool m_joinable{true};
+    bool m_finished{false};
+    std::vector<std::weak_ptr<tunnel_sink>> m_waiters{};
 };
 
+//Request sent on a connection. A tag marks a response to be kept, see store_response(). A
+//share gets a copy of the response as it is sent on.
+struct http_request {
+    std::string method{};
+    std::string tag{};
+    std::shared_ptr<http_share> share{};
+};
+
+//Requests sent on a connection, oldest first. Shared by the filters of both directions, so
+//responses can be matched with their request.
+typedef std::deque<http_request> http_requests;
+
 class http : public tunnel_filter {
 public:
     http(std::string realHost);
     virtual ~http();
 
     bool process(const char * data, const size_t data_length,
-                 std::function<bool(const char * data, const size_t data_length)> f) override;
+                 tunnel_sink & f) override;
+    size_t passthrough(const size_t data_length) override;
+    void track_requests(std::shared_ptr<http_requests> requests);
+    void set_reply(std::shared_ptr<tunnel_sink> reply) override;
+    bool between_messages() const;
 private:
+    bool expect_body();
+    bool answer();
+    bool process_data(const char * data, const size_t data_length, tunnel_sink & f);
+    bool body_pending() const;
+    bool flush_output(tunnel_sink & f);
     virtual std::string filter_http(const std::string & http_data);
-    bool flush_and_reset(std::function<bool(const char * data, const size_t data_length)> f);
+    virtual size_t filter_safe_length(const std::string & http_data);
+    //Answers a complete request to reply without asking the remote, if reply is given. Otherwise
+    //it may tag or share the request, or change its header, before it is sent on.
+    virtual bool answer_request(std::string & header, const std::string & body, http_request & request,
+                                const std::shared_ptr<tunnel_sink> & reply);
+    //Response to a tagged request arrives. plain: its body is sent on as it is.
+    virtual http_content begin_content(const std::string & tag, int status, std::string_view header,
+                                       std::string_view content_type, std::string_view content_length, bool plain);
+    virtual void store_content(const std::string & tag, const char * data, const size_t data_length);
+    //Response, as sent on, to a request tagged by answer_request()
+    virtual void store_response(const std::string & tag, const std::string & response);
+    bool stream_filter(const char * data, const size_t data_length, bool final,
+                       tunnel_sink & f);
+    bool write_chunk(const std::string & chunk, tunnel_sink & f);
+    bool flush_and_reset(tunnel_sink & f);
     bool parse_header_line(const char * line, size_t line_length);
-    void complete_http_header();
+    std::string_view value(const http_value & value) const;
+    void reset_header();
+    void complete_http_header(std::string_view content_length);
+    void end_content();
+    bool write_header(std::string_view content_length, tunnel_sink & f);
     bool process_header(const char * data, const size_t data_length, size_t * processed,
-                        std::function<bool(const char * data, const size_t data_length)> f);
+                        tunnel_sink & f);
     bool process_plain(const char * data, const size_t data_length, size_t * processed,
-                       std::function<bool(const char * data, const size_t data_length)> f);
+                       tunnel_sink & f);
     bool process_chunked(const char * data, const size_t data_length, size_t * processed,
-                         std::function<bool(const char * data, const size_t data_length)> f);
+                         tunnel_sink & f);
     http_state m_state{HTTP_STATE_HEADER};
     bool m_chunked{false};
+    bool m_streaming{false}; //rewrite body while it arrives, send it chunked
+    bool m_bodyless{false}; //HEAD, 1xx, 204 or 304 response, the header describes a body that isn't sent
     size_t m_missing{0};
     size_t m_chunk_missing{0};
     http_header m_header{};
+    std::string m_header_values{}; //Arena for the values in m_header, kept for the next message
     std::string m_header_data{};
     std::string m_http_data{};
     //std::vector<char> m_chunk_data{};
     std::string m_chunk_data{};
     std::string m_chunk_rest{};
     std::string m_rest{}; //Remmber anything not yet a line / tag.
+    std::string m_stream_rest{}; //Body not yet rewritten as it may end in the middle of a match
+    std::string m_stream_out{}; //Rewritten body not yet sent as chunk
+    std::string m_output{}; //Collected output of the current process() call
     std::string m_realHost;
+    std::shared_ptr<http_requests> m_requests{};
+    std::shared_ptr<tunnel_sink> m_reply{};
+    http_content m_content{HTTP_CONTENT_PASS};
+    std::string m_capture_tag{};
+    std::string m_capture{}; //Output of the current response, if it is one to keep
+    std::shared_ptr<http_share> m_share{}; //Gets the output of the current response
 };
 
 
@@ -0,0 +1,78 @@
+/*
+ * dlnatunnel
+ * Copyright (C) 2023 Stefan Wildemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Messages per second through the http filter, for many small pipelined keep-alive responses
+ * arriving in one read. Build with "cmake --build . --target http_bench". */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+
+#include "http.h"
+
+const char soap[] = {
+    "HTTP/1.1 200 OK\r\n"
+    "CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
+    "SERVER: Linux/5.10 UPnP/1.0 MiniDLNA/1.3.0\r\n"
+    "CONTENT-LENGTH: 54\r\n"
+    "\r\n"
+    "<s:Envelope><s:Body><u:X>1</u:X></s:Body></s:Envelope>"
+};
+
+const char thumbnail[] = {
+    "HTTP/1.1 200 OK\r\n"
+    "CONTENT-TYPE: image/jpeg\r\n"
+    "CONTENT-LENGTH: 16\r\n"
+    "\r\n"
+    "0123456789abcdef"
+};
+
+const char head[] = {
+    "HTTP/1.1 200 OK\r\n"
+    "CONTENT-TYPE: video/mp4\r\n"
+    "\r\n"
+};
+
+int main(int argc, char ** argv) {
+    int rounds = (argc > 1) ? atoi(argv[1]) : 200;
+    int per_read = (argc > 2) ? atoi(argv[2]) : 1000;
+    std::string data{};
+    for(int a = 0; a < per_read; a++) {
+        data += (a % 3 == 0) ? soap : ((a % 3 == 1) ? thumbnail : head);
+    }
+
+    std::string buffer{};
+    size_t written = 0;
+    tunnel_sink sink([&buffer](size_t & size) {
+        buffer.resize(size);
+        return buffer.data();
+    }, [&written](size_t, size_t used) {
+        written += used;
+        return true;
+    });
+    http filter{"127.0.0.1:8200"};
+    auto start = std::chrono::steady_clock::now();
+    for(int a = 0; a < rounds; a++) {
+        filter.process(data.data(), data.size(), sink);
+    }
+    std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+    printf("%d messages per read, %.0f messages/s, %.1f MB/s in, %zu bytes out\n", per_read,
+           (rounds * (double) per_read) / took.count(), (rounds * (double) data.size()) / took.count() / 1e6, written);
+    return 0;
+}
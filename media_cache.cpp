@@ -0,0 +1,209 @@
+/*
+ * dlnatunnel
+ * Copyright (C) 2023 Stefan Wildemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+
+#include "media_cache.h"
+#include "debugprintf.h"
+
+media_file::media_file(const std::string & path, size_t length):
+    m_path{path},
+    m_length{length} {
+    m_fd = ::open(path.data(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if(m_fd < 0) {
+        errorprintf("Unable to create cache file %s: %s", path.data(), strerror(errno));
+        return;
+    }
+    //Nobody else needs to see it. Space is freed once the last user closes it.
+    unlink(path.data());
+    //Holes take no space until filled in
+    if(ftruncate(m_fd, length) < 0) {
+        errorprintf("Unable to size cache file %s: %s", path.data(), strerror(errno));
+        close(m_fd);
+        m_fd = -1;
+        return;
+    }
+    void * map = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if(map == MAP_FAILED) {
+        errorprintf("Unable to map cache file %s: %s", path.data(), strerror(errno));
+        close(m_fd);
+        m_fd = -1;
+        return;
+    }
+    m_map = (uint8_t*) map;
+}
+
+media_file::~media_file() {
+    if(m_map != nullptr)
+        munmap(m_map, m_length);
+    if(m_fd >= 0)
+        close(m_fd);
+}
+
+bool media_file::valid() const {
+    return m_map != nullptr;
+}
+
+int media_file::fd() const {
+    return m_fd;
+}
+
+size_t media_file::length() const {
+    return m_length;
+}
+
+size_t media_file::stored() const {
+    return m_stored;
+}
+
+//Bytes available right from offset on
+size_t media_file::cached(size_t offset) const {
+    auto extent = m_extents.upper_bound(offset);
+    if(extent == m_extents.begin())
+        return 0;
+    extent--;
+    if(extent->second <= offset)
+        return 0;
+    return extent->second - offset;
+}
+
+//Returns how many bytes were new
+size_t media_file::write(size_t offset, const char * data, size_t data_length) {
+    if((offset >= m_length) || !valid())
+        return 0;
+    if(data_length > m_length - offset)
+        data_length = m_length - offset;
+    //Blocks for the hole first: a full disk must not turn into SIGBUS on the mapping
+    if(fallocate(m_fd, 0, offset, data_length) == 0) {
+        memcpy(m_map + offset, data, data_length);
+    } else if((errno != EOPNOTSUPP) || (pwrite(m_fd, data, data_length, offset) != (ssize_t) data_length)) {
+        debugprintf("Unable to store %ld bytes: %s", data_length, strerror(errno));
+        return 0;
+    }
+    size_t start = offset;
+    size_t end = offset + data_length;
+    size_t before = m_stored;
+    //Merge with every extent touching [start, end)
+    auto extent = m_extents.upper_bound(start);
+    if(extent != m_extents.begin()) {
+        auto previous = std::prev(extent);
+        if(previous->second >= start)
+            extent = previous;
+    }
+    while((extent != m_extents.end()) && (extent->first <= end)) {
+        if(extent->first < start)
+            start = extent->first;
+        if(extent->second > end)
+            end = extent->second;
+        m_stored -= extent->second - extent->first;
+        extent = m_extents.erase(extent);
+    }
+    m_extents[start] = end;
+    m_stored += end - start;
+    return m_stored - before;
+}
+
+media_cache::media_cache(const std::string & directory, size_t max_size):
+    m_directory{directory},
+    m_max_size{max_size} {
+    mkdir(m_directory.data(), 0700);
+}
+
+media_cache::~media_cache() {
+}
+
+std::shared_ptr<media_file> media_cache::find(const std::string & url) {
+    std::lock_guard<std::recursive_mutex> lock(m_lock);
+    auto file = m_files.find(url);
+    if(file == m_files.end())
+        return std::shared_ptr<media_file> {};
+    file->second->used = ++m_clock;
+    return file->second;
+}
+
+// File for the response now arriving. A different validator or length means the resource changed,
+// what is stored for it is dropped.
+std::shared_ptr<media_file> media_cache::open(const std::string & url, const std::string & validator, size_t length,
+        const std::string & header) {
+    std::lock_guard<std::recursive_mutex> lock(m_lock);
+    auto found = m_files.find(url);
+    if(found != m_files.end()) {
+        if((found->second->validator == validator) && (found->second->length() == length)) {
+            found->second->used = ++m_clock;
+            return found->second;
+        }
+        debugprintf("%s changed, drop it", url.data());
+        m_size -= found->second->stored();
+        found->second->listed = false;
+        m_files.erase(found);
+    }
+    if((length == 0) || (length > m_max_size))
+        return std::shared_ptr<media_file> {};
+    std::string path = m_directory + std::string("/media") + std::to_string(getpid()) + std::string("-")
+                       + std::to_string(m_next_file++);
+    std::shared_ptr<media_file> file = std::make_shared<media_file>(path, length);
+    if(!file->valid())
+        return std::shared_ptr<media_file> {};
+    file->validator = validator;
+    file->header = header;
+    file->used = ++m_clock;
+    file->listed = true;
+    m_files[url] = file;
+    return file;
+}
+
+size_t media_cache::cached(const std::shared_ptr<media_file> & file, size_t offset) {
+    std::lock_guard<std::recursive_mutex> lock(m_lock);
+    return file->cached(offset);
+}
+
+void media_cache::store(const std::shared_ptr<media_file> & file, size_t offset, const char * data,
+                        size_t data_length) {
+    std::lock_guard<std::recursive_mutex> lock(m_lock);
+    //Dropped meanwhile, nobody would find it
+    if(!file->listed)
+        return;
+    m_size += file->write(offset, data, data_length);
+    file->used = ++m_clock;
+    if(m_size > m_max_size)
+        evict(file);
+}
+
+// Least recently used files go until the cache fits again. Files still being sent stay open
+// until the transfer is done.
+void media_cache::evict(const std::shared_ptr<media_file> & keep) {
+    while(m_size > m_max_size) {
+        auto oldest = m_files.end();
+        for(auto file = m_files.begin(); file != m_files.end(); file++) {
+            if((file->second != keep) && ((oldest == m_files.end()) || (file->second->used < oldest->second->used)))
+                oldest = file;
+        }
+        if(oldest == m_files.end())
+            break;
+        debugprintf("Evict %s, %ld bytes", oldest->first.data(), oldest->second->stored());
+        m_size -= oldest->second->stored();
+        oldest->second->listed = false;
+        m_files.erase(oldest);
+    }
+}
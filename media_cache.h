@@ -0,0 +1,84 @@
+/*
+ * dlnatunnel
+ * Copyright (C) 2023 Stefan Wildemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __MEDIA_CACHE_H
+#define __MEDIA_CACHE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+//Default limit in MB
+#define MEDIA_CACHE_SIZE 1024
+
+/* One media resource in the cache: a sparse file of its full length, mapped into memory. Only
+ * the byte ranges (extents) that passed so far are filled in. */
+class media_file {
+public:
+    media_file(const std::string & path, size_t length);
+    ~media_file();
+
+    bool valid() const;
+    int fd() const;
+    size_t length() const;
+    size_t cached(size_t offset) const;
+    size_t stored() const;
+    size_t write(size_t offset, const char * data, size_t data_length);
+
+    std::string validator{}; //ETag and Last-Modified
+    std::string header{}; //header lines to answer with, e.g. content type, DLNA flags
+    uint64_t used{0};
+    bool listed{false}; //still in the cache
+private:
+    std::string m_path;
+    size_t m_length;
+    int m_fd{-1};
+    uint8_t * m_map{nullptr};
+    std::map<size_t, size_t> m_extents{}; //start -> end
+    size_t m_stored{0};
+};
+
+/* Media responses of all hosts, keyed by URL. Files are only valid for the validator they were
+ * stored with. Bounded to max_size bytes of stored extents, the least recently used files go
+ * first. Shared by all sites. */
+class media_cache {
+public:
+    media_cache(const std::string & directory, size_t max_size);
+    ~media_cache();
+
+    std::shared_ptr<media_file> find(const std::string & url);
+    std::shared_ptr<media_file> open(const std::string & url, const std::string & validator, size_t length,
+                                     const std::string & header);
+    size_t cached(const std::shared_ptr<media_file> & file, size_t offset);
+    void store(const std::shared_ptr<media_file> & file, size_t offset, const char * data, size_t data_length);
+private:
+    void evict(const std::shared_ptr<media_file> & keep);
+    std::recursive_mutex m_lock{};
+    std::map<std::string, std::shared_ptr<media_file>> m_files{};
+    std::string m_directory;
+    size_t m_max_size;
+    size_t m_size{0};
+    uint64_t m_clock{0};
+    uint64_t m_next_file{0};
+};
+
+#endif
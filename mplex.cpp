@@ -25,6 +25,15 @@
 #include "debugprintf.h"
 #include <errno.h>
 
+#pragma pack(push,1)
+struct mplex_frame_header {
+    uint8_t magic[4] {'M','P','L','X'};
+    uint16_t type{MPLEX_TYPE_DATA};
+    uint16_t channel{0};
+    int32_t payload_size{0};
+};
+#pragma pack(pop)
+
 constexpr uint32_t mplex_frame_header_size() {
     mplex_frame * f{nullptr};
     return sizeof(*f) - sizeof(f->payload);
@@ -38,6 +47,10 @@ static void on_choke_nop(mplex *, uint32_t, bool) {
     return;
 }
 
+static void on_reset_nop(mplex *, uint32_t) {
+    return;
+}
+
 mplex::mplex(socketmultiplex* mx, int socket, std::function<void(mplex* mpx)> on_ready,
              std::function<bool(mplex * mpx, uint32_t channel, void* reason, uint8_t size)> on_connect):
     m_mx{mx},
@@ -83,10 +96,20 @@ void mplex::remove_attempt(uint32_t channel) {
 
 int mplex::add_channel_listener(uint32_t channel, std::function<bool(mplex * mpx, mplex_frame * frame)> f) {
     debugprintf("Add mpx channel %d", channel);
+    //A channel has one listener, a new one takes over
+    for(auto& helper: m_channels) {
+        if(helper.channel == channel) {
+            helper.f = f;
+            helper.onChoke = on_choke_nop;
+            helper.onReset = on_reset_nop;
+            return channel;
+        }
+    }
     mplex_channel_helper h;
     h.channel=channel;
     h.f = f;
     h.onChoke = on_choke_nop;
+    h.onReset = on_reset_nop;
     m_channels.push_back(h);
     return h.channel;
 }
@@ -104,12 +127,28 @@ void mplex::remove_channel_listener(uint32_t channel) {
     }),m_channels.end());
 }
 
+void mplex::reset_channel(uint32_t channel) {
+    debugprintf("reset mpx channel %d", channel);
+    if(!(m_peer_features & MPLEX_FEATURE_RESET)) {
+        remove_channel_listener(channel);
+        return;
+    }
+    m_channels.erase(std::remove_if(m_channels.begin(), m_channels.end(), [channel, this](mplex_channel_helper &h) {
+        if(channel == h.channel) {
+            send_reset(channel);
+            return true;
+        }
+        return false;
+    }),m_channels.end());
+}
+
 int mplex::add_endpoint_listener(uint32_t channel, std::function<bool(mplex * mpx, mplex_frame * frame)> f) {
     debugprintf("Add mpx endpoint for channel %d", channel);
     mplex_channel_helper h;
     h.channel=channel;
     h.f = f;
     h.onChoke = on_choke_nop;
+    h.onReset = on_reset_nop;
     m_endpoints.push_back(h);
     send_open_response(channel, false);
     return h.channel;
@@ -128,6 +167,22 @@ void mplex::remove_endpoint_listener(uint32_t channel) {
     }),m_endpoints.end());
 }
 
+void mplex::add_endpoint_reset(uint32_t channel, std::function<void(mplex * mpx, uint32_t channel)> onReset) {
+    for(auto& helper: m_endpoints) {
+        if(helper.channel == channel) {
+            helper.onReset = onReset;
+        }
+    }
+}
+
+size_t mplex::endpoint_count() {
+    return m_endpoints.size();
+}
+
+size_t mplex::channel_count() {
+    return m_channels.size();
+}
+
 void mplex::add_channel_choke(uint32_t channel,
                               std::function<void(mplex * mpx, uint32_t channel, bool enabled)> onChoke) {
     for(auto& helper: m_channels) {
@@ -181,7 +236,11 @@ bool mplex::receive(int rq_socket) {
         return true;
     }
     errno = 0;
-    n = read(m_socket, ((uint8_t*)&m_buffer) + m_buffered, sizeof(m_buffer) - m_buffered);
+    n = m_mx->aread(m_socket, ((uint8_t*)&m_buffer) + m_buffered, sizeof(m_buffer) - m_buffered);
+    if((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+        //Nothing complete yet (e.g. partial TLS record).
+        return true;
+    }
     if((n < 0) || ((n == 0) && (errno != EINPROGRESS))) {
         //Socket died. Tell the others wer'e closing.
         debugprintf("CONTROL SOCKET DIED. GOING DOWN n==%d, errno %s", n, strerror(errno));
@@ -219,6 +278,8 @@ bool mplex::process_frame(mplex_frame* frame) {
     switch (frame->type) {
     case MPLEX_TYPE_HELLO:
         debugprintf("Got HELLO frame. Send answer");
+        //The peer's own HELLO always comes before its answer to ours, so this is known once ready.
+        m_peer_features = (frame->payload_size > 0) ? frame->payload.hello.features : 0;
         send_hello_response(frame);
         break;
     case MPLEX_TYPE_DATA: {
@@ -305,6 +366,18 @@ bool mplex::process_frame(mplex_frame* frame) {
         remove_endpoint_listener(frame->channel);
     }
     break;
+    case MPLEX_TYPE_RESET: {
+        //Nobody waits for the rest anymore (e.g. client seeks). Drop it instead of sending it.
+        debugprintf("Remote resets endpoint %d", frame->channel);
+        for(auto helper : m_endpoints) {
+            if(helper.channel == frame->channel) {
+                helper.onReset(this, frame->channel);
+                helper.f(this, nullptr);
+            }
+        }
+        remove_endpoint_listener(frame->channel);
+    }
+    break;
     case MPLEX_TYPE_CLOSE | MPLEX_TYPE_RESPONSE: {
         debugprintf("Remote asks to close channel %d", frame->channel);
         for(auto helper : m_channels) {
@@ -341,7 +414,8 @@ void mplex::send_hello() {
     mplex_frame frame;
     int n;
     frame.type=MPLEX_TYPE_HELLO;
-    frame.payload_size = 0;
+    frame.payload.hello.features = MPLEX_FEATURE_RESET;
+    frame.payload_size = sizeof(frame.payload.hello);
     n=m_mx->awrite(m_socket, &frame, mplex_frame_size(&frame),true);
     if(n != mplex_frame_size(&frame))
         errorprintf("ERROR sending hello");
@@ -418,6 +492,18 @@ void mplex::send_close(uint32_t channel) {
         errorprintf("ERROR sending close");
 }
 
+void mplex::send_reset(uint32_t channel) {
+    debugprintf("Send reset on channel %d", channel);
+    mplex_frame frame;
+    int n;
+    frame.type=MPLEX_TYPE_RESET;
+    frame.channel=channel;
+    frame.payload_size = 0;
+    n=m_mx->awrite(m_socket, &frame, mplex_frame_size(&frame),true);
+    if(n != mplex_frame_size(&frame))
+        errorprintf("ERROR sending reset");
+}
+
 void mplex::send_close_response(uint32_t channel) {
     debugprintf("Send close response on channel %d", channel);
     mplex_frame frame;
@@ -451,3 +537,71 @@ int mplex::send_data_response(uint32_t channel, mplex_frame* frame) {
     return n;
 }
 
+
+//Send payload from any buffer without building a full mplex_frame first.
+int mplex::send_raw(uint16_t type, uint32_t channel, const void * data, size_t size) {
+    mplex_frame_header header;
+    static_assert(sizeof(header) == mplex_frame_header_size(), "frame header mismatch");
+    const uint8_t * pos = (const uint8_t *) data;
+    size_t left = size;
+    do {
+        size_t chunk = left;
+        if(chunk > sizeof(mplex_frame::payload))
+            chunk = sizeof(mplex_frame::payload);
+        header.type = type;
+        header.channel = channel;
+        header.payload_size = chunk;
+        if(m_mx->awrite(m_socket, &header, sizeof(header), true) != sizeof(header))
+            return -1;
+        if((chunk > 0) && (m_mx->awrite(m_socket, pos, chunk, true) != chunk))
+            return -1;
+        pos += chunk;
+        left -= chunk;
+    } while(left > 0);
+    return sizeof(header) + size;
+}
+
+int mplex::send_data(uint32_t channel, const void * data, size_t size) {
+    int n = send_raw(MPLEX_TYPE_DATA, channel, data, size);
+    if(n < 0)
+        errorprintf("ERROR sending data");
+    return n;
+}
+
+uint8_t * mplex::reserve_data(uint32_t channel, size_t size) {
+    if(size > sizeof(mplex_frame::payload))
+        size = sizeof(mplex_frame::payload);
+    m_reserved = m_mx->write_reserve(m_socket, mplex_frame_header_size() + size);
+    if(m_reserved == nullptr)
+        return nullptr;
+    m_reserved_size = size;
+    mplex_frame_header header;
+    header.type = MPLEX_TYPE_DATA;
+    header.channel = channel;
+    header.payload_size = size;
+    memcpy(m_reserved, &header, sizeof(header));
+    return m_reserved + sizeof(header);
+}
+
+int mplex::commit_data(size_t used) {
+    if(m_reserved == nullptr)
+        return -1;
+    mplex_frame_header header;
+    memcpy(&header, m_reserved, sizeof(header));
+    header.payload_size = used;
+    memcpy(m_reserved, &header, sizeof(header));
+    size_t reserved = mplex_frame_header_size() + m_reserved_size;
+    m_reserved = nullptr;
+    //An empty data frame would close the channel on the other side. Drop it.
+    int n = m_mx->write_commit(m_socket, reserved, (used > 0) ? (mplex_frame_header_size() + used) : 0, true);
+    if(n < 0)
+        errorprintf("ERROR sending data");
+    return n;
+}
+
+int mplex::send_data_response(uint32_t channel, const void * data, size_t size) {
+    int n = send_raw(MPLEX_TYPE_DATA | MPLEX_TYPE_RESPONSE, channel, data, size);
+    if(n < 0)
+        errorprintf("ERROR sending data response");
+    return n;
+}
@@ -30,6 +30,10 @@ class mplex;
 #define MPLEX_TYPE_OPEN     0x2000
 #define MPLEX_TYPE_CLOSE    0x3000
 #define MPLEX_TYPE_CHOKE    0x4000
+#define MPLEX_TYPE_RESET    0x5000
+
+//Features announced in the HELLO payload. Peers sending an empty HELLO know none of them.
+#define MPLEX_FEATURE_RESET 0x01
 
 #pragma pack(push,1)
 struct mplex_frame {
@@ -47,6 +51,9 @@ struct mplex_frame {
         struct {
             bool enable;
         } choke;
+        struct {
+            uint8_t features;
+        } hello;
     } payload ;
 } ;
 #pragma pack(pop)
@@ -61,6 +68,7 @@ struct mplex_channel_helper {
     uint32_t channel{0};
     std::function<bool(mplex * mpx, mplex_frame * frame)> f{};
     std::function<void(mplex * mpx, uint32_t channel, bool enabled)> onChoke{};
+    std::function<void(mplex * mpx, uint32_t channel)> onReset{};
 };
 
 class mplex {
@@ -75,16 +83,28 @@ public:
     void add_channel_choke(uint32_t channel, std::function<void(mplex * mpx, uint32_t channel, bool enabled)> onChoke);
     void add_endpoint_choke(uint32_t channel, std::function<void(mplex * mpx, uint32_t channel, bool enabled)> onChoke);
     void remove_channel_listener(uint32_t channel);
+    //Like remove_channel_listener(), but the endpoint drops whatever it still has for the channel.
+    //Peers that do not know RESET get a plain close.
+    void reset_channel(uint32_t channel);
     int add_endpoint_listener(uint32_t channel, std::function<bool(mplex * mpx, mplex_frame * frame)> f);
     void remove_endpoint_listener(uint32_t channel);
+    void add_endpoint_reset(uint32_t channel, std::function<void(mplex * mpx, uint32_t channel)> onReset);
 
     int send_data(uint32_t channel, mplex_frame* frame);
+    int send_data(uint32_t channel, const void * data, size_t size);
+    //Payload space of a data frame right inside the socket's write buffer, so a producer can fill
+    //it without an extra copy. Send it with commit_data() before sending anything else.
+    uint8_t * reserve_data(uint32_t channel, size_t size);
+    int commit_data(size_t used);
     int send_data_response(uint32_t channel, mplex_frame* frame);
+    int send_data_response(uint32_t channel, const void * data, size_t size);
 
     void send_choke(uint32_t channel, bool enable);
     void send_choke_response(uint32_t channel, bool enable);
 
     bool receive(int socket);
+    size_t endpoint_count();
+    size_t channel_count();
 private:
     void close_all();
     void remove_attempt(uint32_t channel);
@@ -95,10 +115,15 @@ private:
     void send_open_response(uint32_t channel, bool failure);
     void send_close(uint32_t channel);
     void send_close_response(uint32_t channel);
+    void send_reset(uint32_t channel);
+    int send_raw(uint16_t type, uint32_t channel, const void * data, size_t size);
     mplex_frame m_buffer;
     uint32_t m_buffered;
+    uint8_t * m_reserved{nullptr}; //frame header of the data frame handed out by reserve_data()
+    size_t m_reserved_size{0};
     uint32_t m_free_channel;
     bool m_ready;
+    uint8_t m_peer_features{0};
     int m_socket;
     socketmultiplex* m_mx;
     std::function<void(mplex* mpx)> m_on_ready;
@@ -23,11 +23,21 @@
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <getopt.h>
+#include <atomic>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
 #include "debugprintf.h"
 
 #include "socketmultiplex.h"
 #include "tunnel.h"
 #include "collector.h"
+#include "tls.h"
+#include "tunnel_worker.h"
+#include "ssdp_hub.h"
+#include "media_cache.h"
+#include "http.h"
 
 static volatile bool running = true;
 static void intHandler(int) {
@@ -35,117 +45,455 @@ static void intHandler(int) {
     running=false;
 }
 
+//Client: number of upstream sites still connected
+static std::atomic<int> sites_alive{0};
+static void site_down() {
+    if(--sites_alive <= 0) {
+        fprintf(stderr, "No site left\n");
+        running=false;
+    }
+}
+
 static ssdp s_ssdp{};
 
+static void usage(const char * name) {
+    fprintf(stderr, "usage: %s [options] <tunnel port>                         (server)\n", name);
+    fprintf(stderr, "       %s [options] <host> <tunnel port> [<host> <port>...] (client)\n", name);
+    fprintf(stderr, "       %s [options] --stdio                               (server on stdin/stdout)\n", name);
+    fprintf(stderr, "       %s [options] --exec <command> [--exec <command>...] (client to server spawned by command)\n",
+            name);
+    fprintf(stderr, "A client may connect to several servers (sites) at once, even mixing both forms.\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  --psk <file>           encrypt tunnel using TLS 1.3 with pre shared key from file\n");
+    fprintf(stderr, "  --psk-identity <name>  PSK identity (default dlnatunnel)\n");
+    fprintf(stderr, "  --cert <file>          encrypt tunnel using TLS 1.3 with this PEM certificate (chain)\n");
+    fprintf(stderr, "  --key <file>           private key for --cert (default: read from cert file)\n");
+    fprintf(stderr, "  --ca <file>            verify peer certificate against this CA (client default: system CAs)\n");
+    fprintf(stderr, "  --local-ip <ip>        address announced to local uPnP clients\n");
+    fprintf(stderr, "  --workers <n>          server: number of threads serving client tunnels (default 1)\n");
+    fprintf(stderr, "  --max-tunnels <n>      server: maximum number of concurrent client tunnels (default unlimited)\n");
+    fprintf(stderr, "  --max-channels <n>     server: maximum number of open channels per tunnel (default unlimited)\n");
+    fprintf(stderr, "  --read-ahead <n>       server: keep reading up to n KB per connection while the client is busy\n");
+    fprintf(stderr, "  --upstream-idle <n>    server: idle connections kept per media server for reuse (default 4, 0 off)\n");
+    fprintf(stderr, "  --rate <n>             server: limit each tunnel to n kbit/s\n");
+    fprintf(stderr, "  --channel-rate <n>     server: limit each media stream to n kbit/s\n");
+    fprintf(stderr, "  --channel-idle <s>     client: close connections without traffic for s seconds (default 600, 0 off)\n");
+    fprintf(stderr, "  --port-idle <s>        client: drop forwards nobody used for s seconds (default 3600, 0 off)\n");
+    fprintf(stderr, "  --media-cache <dir>    client: keep streamed media in sparse files below this directory\n");
+    fprintf(stderr, "  --media-cache-size <n> client: media cache limit in MB (default %d)\n", MEDIA_CACHE_SIZE);
+    fprintf(stderr, "  --share-backlog <n>    client: KB of a shared response kept for clients that join late "
+            "(default %d)\n", HTTP_SHARE_BACKLOG >> 10);
+}
+
+static void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    flags |= O_NONBLOCK;
+    fcntl(fd, F_SETFL, flags);
+}
+
+// Run command with its stdin/stdout connected to a socket pair, e.g. "ssh host dlnatunnel --stdio"
+static int spawn_command(const char * command) {
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("ERROR creating socketpair");
+        return -1;
+    }
+    pid_t pid = fork();
+    if(pid < 0) {
+        perror("ERROR on fork");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if(pid == 0) {
+        close(sv[0]);
+        dup2(sv[1], STDIN_FILENO);
+        dup2(sv[1], STDOUT_FILENO);
+        close(sv[1]);
+        execl("/bin/sh", "sh", "-c", command, (char*) nullptr);
+        perror("ERROR on exec");
+        _exit(127);
+    }
+    close(sv[1]);
+    set_nonblocking(sv[0]);
+    return sv[0];
+}
+
+// Client: run one upstream tunnel inside the sites worker
+static void start_client(tunnel_worker * worker, collector * col, int port_socket) {
+    worker->add_tunnel(port_socket, -1, [col](tunnel * tn) {
+        fprintf(stderr, "TUNNEL ready\n");
+        col->use_tunnel(tn);
+    }, [col](tunnel * tn) {
+        col->drop_tunnel(tn);
+        site_down();
+    });
+}
+
+// Address of the interface we would use for SSDP multicast. Nothing is sent.
+static std::string guess_local_ip() {
+    char myIP[16] = "127.0.0.1";
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if(s < 0)
+        return std::string(myIP);
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(1900);
+    addr.sin_addr.s_addr = inet_addr("239.255.255.250");
+    if(connect(s, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+        socklen_t len = sizeof(addr);
+        getsockname(s, (struct sockaddr *) &addr, &len);
+        inet_ntop(AF_INET, &addr.sin_addr, myIP, sizeof(myIP));
+    }
+    close(s);
+    return std::string(myIP);
+}
+
 class dlnatunnel {
 public:
     dlnatunnel() {
     };
     ~dlnatunnel() {
+        //Workers first, they use m_tls
+        for(auto worker: m_workers)
+            delete worker;
+        if(m_ssdp_hub != nullptr)
+            delete m_ssdp_hub;
+        if(m_pool != nullptr)
+            delete m_pool;
         if(m_px != nullptr)
             delete m_px;
-        if(m_tun != nullptr);
-        delete m_tun;
-        if(m_col != nullptr);
-        delete m_col;
+        if(m_tls != nullptr)
+            delete m_tls;
+        if(m_tun != nullptr)
+            delete m_tun;
+        if(m_col != nullptr)
+            delete m_col;
     };
     void kill() {
-        if(m_tun != nullptr);
-        delete m_tun;
-        if(m_col != nullptr);
-        delete m_col;
+        if(m_tun != nullptr)
+            delete m_tun;
+        if(m_col != nullptr)
+            delete m_col;
 
         m_tun=nullptr;
         m_col=nullptr;
+        if(m_on_kill)
+            m_on_kill();
     };
     socketmultiplex * m_px{nullptr};
     tunnel * m_tun{nullptr};
     collector * m_col{nullptr};
+    tls_context * m_tls{nullptr};
+    std::vector<tunnel_worker*> m_workers{};
+    ssdp_hub * m_ssdp_hub{nullptr};
+    upstream_pool * m_pool{nullptr};
+    std::function<void(void)> m_on_kill{};
 };
 
 int main(int argc, char *argv[]) {
-    const char* host = nullptr;
     const char* port = nullptr;
     bool server=false;
-    if ((argc > 2) && (argc < 3)) {
-        fprintf(stderr,"ERROR, no host and port provided\n");
-        exit(1);
-    } else if (argc < 2) {
-        fprintf(stderr,"ERROR, no port provided\n");
-        exit(1);
+    bool use_stdio=false;
+    std::vector<std::pair<const char*, const char*>> upstreams{};
+    std::vector<const char*> exec_commands{};
+    std::string local_ip{};
+    int worker_count = 1;
+    size_t max_tunnels = 0;
+    tunnel_limits limits{};
+    tls_config tls{};
+    std::string media_directory{};
+    size_t media_size = MEDIA_CACHE_SIZE;
+    size_t share_backlog = HTTP_SHARE_BACKLOG >> 10;
+    static const struct option options[] = {
+        {"psk", required_argument, nullptr, 'p'},
+        {"psk-identity", required_argument, nullptr, 'i'},
+        {"cert", required_argument, nullptr, 'c'},
+        {"key", required_argument, nullptr, 'k'},
+        {"ca", required_argument, nullptr, 'a'},
+        {"stdio", no_argument, nullptr, 's'},
+        {"exec", required_argument, nullptr, 'e'},
+        {"local-ip", required_argument, nullptr, 'l'},
+        {"workers", required_argument, nullptr, 'w'},
+        {"max-tunnels", required_argument, nullptr, 'T'},
+        {"max-channels", required_argument, nullptr, 'C'},
+        {"read-ahead", required_argument, nullptr, 'R'},
+        {"upstream-idle", required_argument, nullptr, 'U'},
+        {"rate", required_argument, nullptr, 'r'},
+        {"channel-rate", required_argument, nullptr, 'B'},
+        {"channel-idle", required_argument, nullptr, 'I'},
+        {"port-idle", required_argument, nullptr, 'P'},
+        {"media-cache", required_argument, nullptr, 'm'},
+        {"media-cache-size", required_argument, nullptr, 'M'},
+        {"share-backlog", required_argument, nullptr, 'S'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int opt;
+    while((opt = getopt_long(argc, argv, "h", options, nullptr)) != -1) {
+        switch(opt) {
+        case 'p':
+            tls.psk_file = optarg;
+            break;
+        case 'i':
+            tls.psk_identity = optarg;
+            break;
+        case 'c':
+            tls.cert_file = optarg;
+            break;
+        case 'k':
+            tls.key_file = optarg;
+            break;
+        case 'a':
+            tls.ca_file = optarg;
+            break;
+        case 's':
+            use_stdio = true;
+            break;
+        case 'e':
+            exec_commands.push_back(optarg);
+            break;
+        case 'l':
+            local_ip = optarg;
+            break;
+        case 'w':
+            worker_count = atoi(optarg);
+            break;
+        case 'T':
+            max_tunnels = atoi(optarg);
+            break;
+        case 'C':
+            limits.max_channels = atoi(optarg);
+            break;
+        case 'R':
+            limits.read_ahead = (size_t) atol(optarg) << 10;
+            break;
+        case 'U':
+            limits.upstream_idle = atol(optarg);
+            break;
+        case 'r':
+            limits.rate = (size_t) atol(optarg) * 1000 / 8;
+            break;
+        case 'B':
+            limits.channel_rate = (size_t) atol(optarg) * 1000 / 8;
+            break;
+        case 'I':
+            limits.channel_idle = atol(optarg);
+            break;
+        case 'P':
+            limits.port_idle = atol(optarg);
+            break;
+        case 'm':
+            media_directory = optarg;
+            break;
+        case 'M':
+            media_size = atol(optarg);
+            break;
+        case 'S':
+            share_backlog = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
     }
-    if(argc==2) {
+    int args = argc - optind;
+    if(use_stdio) {
+        if((args != 0) || !exec_commands.empty()) {
+            fprintf(stderr,"ERROR, no host, port or --exec allowed with --stdio\n");
+            usage(argv[0]);
+            exit(1);
+        }
+        if(tls.enabled()) {
+            fprintf(stderr,"ERROR, TLS is not supported with --stdio\n");
+            exit(1);
+        }
         server = true;
-        port = argv[1];
-    }
-    if(argc==3) {
+    } else if((args == 1) && exec_commands.empty()) {
+        server = true;
+        port = argv[optind];
+    } else if((args % 2) == 0) {
         server = false;
-        host = argv[1];
-        port = argv[2];
+        for(int a = optind; a < argc; a += 2) {
+            upstreams.push_back({argv[a], argv[a + 1]});
+        }
+        if(upstreams.empty() && exec_commands.empty()) {
+            fprintf(stderr,"ERROR, no port provided\n");
+            usage(argv[0]);
+            exit(1);
+        }
+        if(tls.enabled() && !exec_commands.empty()) {
+            fprintf(stderr,"ERROR, TLS is not supported with --exec\n");
+            exit(1);
+        }
+    } else {
+        fprintf(stderr,"ERROR, host and port expected\n");
+        usage(argv[0]);
+        exit(1);
     }
     signal(SIGINT, intHandler);
     dlnatunnel dtun{};
     dtun.m_px = new socketmultiplex{};
+    if(tls.enabled()) {
+        dtun.m_tls = new tls_context(tls, server);
+        if(!dtun.m_tls->valid()) {
+            fprintf(stderr, "ERROR, unable to set up TLS\n");
+            exit(1);
+        }
+    }
 
-    if(! server) {
-        dtun.m_px->connect_port(host, atoi(port), [&dtun] (int port_socket) {
-            fprintf(stderr, "connect connection %d\n", port_socket);
-            // Get my ip address and port
-            char myIP[16];
-            unsigned int myPort;
-            struct sockaddr_in  my_addr;
-            bzero(&my_addr, sizeof(my_addr));
-            socklen_t len = sizeof(my_addr);
-            getsockname(port_socket, (struct sockaddr *) &my_addr, &len);
-            inet_ntop(AF_INET, &my_addr.sin_addr, myIP, sizeof(myIP));
-            myPort = ntohs(my_addr.sin_port);
-            errorprintf("%s:%d", myIP, myPort);
-
-            dtun.m_col = new collector(std::string(myIP));
-            dtun.m_col->use_px(dtun.m_px);
-            dtun.m_tun = new tunnel(dtun.m_px, port_socket, [&dtun](tunnel * tn) {
-                fprintf(stderr, "TUNNEL ready\n");
-                dtun.m_col->use_tunnel(dtun.m_tun);
-
-                return true;
-            });
+    std::function<void(int, int)> start_server = [&dtun, limits] (int port_socket, int write_socket) {
+        dtun.m_tun = new tunnel(dtun.m_px, port_socket, [](tunnel * tn) {
+            fprintf(stderr, "TUNNEL ready\n");
+            return;
+        });
+        dtun.m_tun->set_max_channels(limits.max_channels);
+        dtun.m_tun->set_read_ahead(limits.read_ahead);
+        dtun.m_tun->set_rate(limits.rate, limits.channel_rate);
+        dtun.m_tun->use_ssdp_hub(dtun.m_ssdp_hub);
+        dtun.m_tun->use_upstream_pool(dtun.m_pool);
+        dtun.m_px->register_socket_callback(port_socket, [&dtun] (int port_socket) {
+            if(!dtun.m_tun->receive(port_socket)) {
+                dtun.kill();
+                return false;
+            }
+            return true;
+        }, write_socket);
+        dtun.m_tun->run();
+    };
+
+    if(server) {
+        //All tunnels share one SSDP listener
+        dtun.m_ssdp_hub = new ssdp_hub(dtun.m_px);
+        if(!dtun.m_ssdp_hub->open()) {
+            delete dtun.m_ssdp_hub;
+            dtun.m_ssdp_hub = nullptr;
+        }
+    }
+    if(use_stdio) {
+        //Started by sshd or inetd: tunnel runs on our stdin/stdout.
+        set_nonblocking(STDIN_FILENO);
+        set_nonblocking(STDOUT_FILENO);
+        dtun.m_pool = new upstream_pool(dtun.m_px, limits.upstream_idle);
+        start_server(STDIN_FILENO, STDOUT_FILENO);
+        //Once the peer is gone there is nobody to serve anymore.
+        dtun.m_on_kill = [&dtun] () {
+            dtun.m_pool->report();
+            running=false;
+        };
+    } else if(! server) {
+        //Every site gets its own event loop. The collector merges what they find.
+        dtun.m_col = new collector(local_ip);
+        dtun.m_col->use_px(dtun.m_px);
+        if(!media_directory.empty())
+            dtun.m_col->use_media_cache(std::make_shared<media_cache>(media_directory, media_size << 20));
+        dtun.m_col->use_share_backlog(share_backlog << 10);
+        collector * col = dtun.m_col;
+        tls_context * tls_ctx = dtun.m_tls;
+        std::vector<std::function<void(tunnel_worker*, socketmultiplex*)>> sites{};
+        for(auto& upstream: upstreams) {
+            std::string host{upstream.first};
+            uint16_t tunnel_port = atoi(upstream.second);
+            sites.push_back([col, tls_ctx, host, tunnel_port] (tunnel_worker* worker, socketmultiplex* mx) {
+                int result = mx->connect_port(host.data(), tunnel_port, [col, tls_ctx, host, worker, mx] (int port_socket) {
+                    fprintf(stderr, "connect connection %d to %s\n", port_socket, host.data());
+                    auto open = [col, worker] (int port_socket, bool ok) {
+                        if(!ok) {
+                            site_down();
+                            return;
+                        }
+                        // Get my ip address and port
+                        char myIP[16];
+                        unsigned int myPort;
+                        struct sockaddr_in  my_addr;
+                        bzero(&my_addr, sizeof(my_addr));
+                        socklen_t len = sizeof(my_addr);
+                        getsockname(port_socket, (struct sockaddr *) &my_addr, &len);
+                        inet_ntop(AF_INET, &my_addr.sin_addr, myIP, sizeof(myIP));
+                        myPort = ntohs(my_addr.sin_port);
+                        errorprintf("%s:%d", myIP, myPort);
+                        col->use_local_ip(std::string(myIP));
 
-            dtun.m_px->register_socket_callback(port_socket, [&dtun] (int port_socket) {
-                if(!dtun.m_tun->receive(port_socket)) {
-                    running=false;
-                    dtun.kill();
-                    return false;
+                        start_client(worker, col, port_socket);
+                    };
+                    if(tls_ctx == nullptr) {
+                        open(port_socket, true);
+                    } else if(!tls_ctx->secure(mx, port_socket, open, host.data())) {
+                        site_down();
+                        return false;
+                    }
+                    return true;
+                });
+                if(result < 0)
+                    site_down();
+            });
+        }
+        for(auto command: exec_commands) {
+            std::string cmd{command};
+            sites.push_back([col, cmd] (tunnel_worker* worker, socketmultiplex* mx) {
+                int tunnel_socket = spawn_command(cmd.data());
+                if(tunnel_socket < 0) {
+                    site_down();
+                    return;
                 }
-                return true;
+                col->use_local_ip(guess_local_ip());
+                start_client(worker, col, tunnel_socket);
             });
-            dtun.m_tun->run();
-            return true;
-        });
+        }
+        for(auto& site: sites) {
+            tunnel_worker * worker = new tunnel_worker(dtun.m_tls, limits);
+            if(!worker->start()) {
+                delete worker;
+                exit(1);
+            }
+            dtun.m_workers.push_back(worker);
+            sites_alive ++;
+            worker->post([worker, site](socketmultiplex* mx) {
+                site(worker, mx);
+            });
+        }
     } else {
-        std::function<void(int)> f = [&dtun] (int port_socket) {
-            fprintf(stderr, "port forward connection\n");
-            dtun.m_tun = new tunnel(dtun.m_px, port_socket, [](tunnel * tn) {
-                fprintf(stderr, "TUNNEL ready\n");
+        if(worker_count < 1)
+            worker_count = 1;
+        for(int a = 0; a < worker_count; a++) {
+            tunnel_worker * worker = new tunnel_worker(dtun.m_tls, limits, dtun.m_ssdp_hub);
+            if(!worker->start()) {
+                delete worker;
+                exit(1);
+            }
+            dtun.m_workers.push_back(worker);
+        }
+        //Hand each client tunnel to the least busy worker
+        std::function<void(int)> f = [&dtun, max_tunnels] (int port_socket) {
+            size_t total = 0;
+            tunnel_worker * worker = nullptr;
+            for(auto w: dtun.m_workers) {
+                size_t count = w->tunnel_count();
+                total += count;
+                if((worker == nullptr) || (count < worker->tunnel_count()))
+                    worker = w;
+            }
+            if((max_tunnels > 0) && (total >= max_tunnels)) {
+                errorprintf("Tunnel limit of %ld reached, reject connection", max_tunnels);
+                close(port_socket);
                 return;
-            });
-            dtun.m_px->register_socket_callback(port_socket, [&dtun] (int port_socket) {
-                if(!dtun.m_tun->receive(port_socket)) {
-                    dtun.kill();
-                    return false;
-                }
-                return true;
-            });
-            dtun.m_tun->run();
+            }
+            fprintf(stderr, "port forward connection\n");
+            worker->add_connection(port_socket);
         };
-        dtun.m_px->add_port_listener(atoi(argv[1]), f);
+        dtun.m_px->add_port_listener(atoi(port), f);
     }
     while(running) {
         struct timeval tv;
         tv.tv_sec=1;
         tv.tv_usec=0;
         dtun.m_px->handle_sockets(tv);
+        if(dtun.m_pool != nullptr)
+            dtun.m_pool->expire();
     }
-    dtun.m_px->remove_port_listener(atoi(argv[1]));
+    if(port != nullptr)
+        dtun.m_px->remove_port_listener(atoi(port));
     return 0;
 }
 
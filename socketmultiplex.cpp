@@ -28,9 +28,11 @@
 #include <netdb.h>
 #include <errno.h>
 #include <signal.h>
+#include <sys/sendfile.h>
 
 #include <vector>
 #include "socketmultiplex.h"
+#include "token_bucket.h"
 
 #include <fcntl.h>
 #include "debugprintf.h"
@@ -39,24 +41,79 @@ static void on_choke_nop(int, bool) {
     return;
 }
 
-static bool try_write(socket_helper &helper) {
-    if(helper.writebuffer.size() > 0) {
+static inline int write_fd(const socket_helper &helper) {
+    return (helper.write_socket < 0) ? helper.socket : helper.write_socket;
+}
+
+#define SENDFILE_MAX (1024 * 1024) //per call, so one file doesn't hold up the loop
+
+ssize_t socketmultiplex::write_buffered(socket_helper &helper, size_t size) {
+    ssize_t n;
+    auto io = m_io.find(helper.socket);
+    if(io != m_io.end())
+        n=io->second.write(helper.socket, helper.writebuffer.data(), size);
+    else
+        n=write(write_fd(helper), helper.writebuffer.data(), size);
+    if(n <= 0)
+        return n;
+    if(n == helper.writebuffer.size()) {
+        helper.writebuffer.clear();
+    } else {
+        helper.writebuffer.erase(helper.writebuffer.begin(), helper.writebuffer.begin() + n);
+    }
+    for(auto& file: helper.files) {
+        file.after -= n;
+    }
+    return n;
+}
+
+ssize_t socketmultiplex::write_file(socket_helper &helper) {
+    file_segment& file = helper.files.front();
+    size_t size = (file.length > SENDFILE_MAX) ? SENDFILE_MAX : file.length;
+    ssize_t n;
+    if(file.data != nullptr) {
+        auto io = m_io.find(helper.socket);
+        if(io != m_io.end())
+            n = io->second.write(helper.socket, file.data + file.offset, size);
+        else
+            n = write(write_fd(helper), file.data + file.offset, size);
+        if(n <= 0)
+            return n;
+        file.offset += n;
+    } else {
+        n = sendfile(write_fd(helper), file.fd, &file.offset, size);
+        if(n == 0) {
+            //File is shorter than it should be
+            errno = EIO;
+            return -1;
+        }
+    }
+    if(n < 0)
+        return n;
+    file.length -= n;
+    if(file.length == 0)
+        helper.files.erase(helper.files.begin());
+    return n;
+}
+
+bool socketmultiplex::try_write(socket_helper &helper) {
+    //Buffer and files go out in the order they were queued
+    while((helper.writebuffer.size() > 0) || !helper.files.empty()) {
         errno = 0;
-        int n=write(helper.socket, helper.writebuffer.data(), helper.writebuffer.size());
-        if(n == helper.writebuffer.size()) {
-            helper.writebuffer.clear();
-        } else if(n > 0) {
-            std::vector<uint8_t> rest{};
-            for(int a = 0; a < helper.writebuffer.size() - n; a ++) {
-                rest.push_back(helper.writebuffer.data()[n + a]);
-            }
-            helper.writebuffer = rest;
-        } else {
+        bool file = !helper.files.empty() && (helper.files.front().after == 0);
+        size_t size = file ? helper.files.front().length : (helper.files.empty() ? helper.writebuffer.size() :
+                      helper.files.front().after);
+        ssize_t n = file ? write_file(helper) : write_buffered(helper, size);
+        if(n <= 0) {
             if(errno == EAGAIN || errno == EWOULDBLOCK)
                 return true;
-            debugprintf("%d %s", n, strerror(errno));
+            debugprintf("%ld %s", n, strerror(errno));
             return false;
         }
+        if(n < size) {
+            //Socket is full
+            break;
+        }
     }
     debugprintf("%ld bytes left", helper.writebuffer.size());
     return true;
@@ -129,6 +186,9 @@ static int serversocket (uint16_t port) {
         perror( "ERROR opening socket");
         return listen_fd;
     }
+    //Ports are used again, maybe while connections of their last use are in TIME_WAIT
+    int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     bzero((char *) &serv_addr, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = INADDR_ANY;
@@ -150,8 +210,20 @@ static int serversocket (uint16_t port) {
 socketmultiplex::socketmultiplex():
     listener{},
     connections{},
-    attempts{} {
+    m_removed{},
+    attempts{},
+    m_io{},
+    m_post_lock{},
+    m_posted{} {
     signal(SIGPIPE, SIG_IGN);
+    if(pipe(m_post_pipe) < 0) {
+        perror("ERROR creating pipe");
+    } else {
+        for(auto fd: m_post_pipe) {
+            int flags = fcntl(fd, F_GETFL, 0);
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        }
+    }
 };
 
 socketmultiplex::~socketmultiplex() {
@@ -160,10 +232,40 @@ socketmultiplex::~socketmultiplex() {
     }
     for(auto& helper: connections) {
         close(helper.socket);
+        if(write_fd(helper) != helper.socket)
+            close(write_fd(helper));
     }
     for(auto& helper: listener) {
         close(helper.socket);
     }
+    for(auto fd: m_post_pipe) {
+        if(fd >= 0)
+            close(fd);
+    }
+}
+
+void socketmultiplex::post(std::function<void(void)> f) {
+    {
+        std::lock_guard<std::mutex> lock(m_post_lock);
+        m_posted.push_back(f);
+    }
+    char c = 0;
+    if(write(m_post_pipe[1], &c, 1) < 0 && (errno != EAGAIN)) {
+        perror("ERROR on post");
+    }
+}
+
+void socketmultiplex::run_posted() {
+    char buffer[64];
+    while(read(m_post_pipe[0], buffer, sizeof(buffer)) > 0);
+    std::vector<std::function<void(void)>> posted{};
+    {
+        std::lock_guard<std::mutex> lock(m_post_lock);
+        posted.swap(m_posted);
+    }
+    for(auto& f: posted) {
+        f();
+    }
 }
 
 int socketmultiplex::connect_port(const char * url, uint16_t port, std::function<bool(int socket)> f) {
@@ -268,27 +370,41 @@ void socketmultiplex::remove_port_listener(uint16_t listen_port) {
 }
 
 void socketmultiplex::remove_socket_callback(int socket) {
-    if(m_processing_connections)
-        debugprintf("called while processing");
     debugprintf("close socket %d", socket);
     if(connections.size() == 0)
         return;
-    connections.erase(std::remove_if(connections.begin(), connections.end(), [socket](socket_helper &h) {
+    if(m_processing_connections) {
+        //The callback might be the one running right now, or the socket may be next in line.
+        //Just mark it. It is erased (and closed) once the pass is done.
+        debugprintf("called while processing");
+        for(auto& helper: connections) {
+            if((helper.socket == socket) && !helper.removed) {
+                helper.removed = true;
+                m_removed.push_back(socket);
+            }
+        }
+        return;
+    }
+    connections.remove_if([this, socket](socket_helper &h) {
         if(socket == h.socket) {
             //try to flush write. May succeed or not.
             try_write(h);
             close(socket);
+            if(write_fd(h) != socket)
+                close(write_fd(h));
             return true;
         }
         return false;
-    }),connections.end());
+    });
+    m_io.erase(socket);
 }
 
-int socketmultiplex::register_socket_callback(int socket, std::function<bool(int socket)> f) {
+int socketmultiplex::register_socket_callback(int socket, std::function<bool(int socket)> f, int write_socket) {
     if(m_processing_connections)
         debugprintf("called while processing");
     socket_helper h;
     h.socket=socket;
+    h.write_socket=write_socket;
     h.onChoke = on_choke_nop;
     h.f=f;
     for(auto& helper: connections) {
@@ -313,27 +429,141 @@ void socketmultiplex::add_socket_choke(uint16_t socket, std::function<void(int s
     }
 }
 
-ssize_t socketmultiplex::awrite(int socket, const void *data, size_t size, bool block) {
+void socketmultiplex::set_socket_io(int socket, socket_io io) {
+    m_io[socket] = io;
+}
+
+ssize_t socketmultiplex::aread(int socket, void *buf, size_t count) {
+    auto io = m_io.find(socket);
+    if(io != m_io.end())
+        return io->second.read(socket, buf, count);
+    return read(socket, buf, count);
+}
+
+size_t socketmultiplex::pending(int socket) {
+    auto io = m_io.find(socket);
+    if((io != m_io.end()) && io->second.pending)
+        return io->second.pending(socket);
+    return 0;
+}
+
+socket_helper * socketmultiplex::find_connection(int socket) {
     for(auto& helper : connections) {
-        if(helper.socket == socket) {
-            debugprintf("add %ld bytes to writebuffer on %d", size, socket);
-            for(int a = 0; a < size; a ++)
-                helper.writebuffer.push_back(((uint8_t*) data)[a]);
-            bool result = false;
-            do {
-                result = try_write(helper);
-                if(errno == EAGAIN || errno == EWOULDBLOCK)
-                    usleep(1000);
-            } while(result && block && (helper.writebuffer.size() > 0));
-            if((helper.writebuffer.size()> 1000) && (!helper.choke_requested)) {
-                helper.onChoke(helper.socket, true);
-                helper.choke_requested=true;
-            }
-            return size;
+        if((helper.socket == socket) && !helper.removed)
+            return &helper;
+    }
+    return nullptr;
+}
+
+void socketmultiplex::flush(socket_helper &helper, bool block) {
+    bool result = false;
+    do {
+        result = try_write(helper);
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+            usleep(1000);
+    } while(result && block && ((helper.writebuffer.size() > 0) || !helper.files.empty()));
+    if((helper.writebuffer.size()> 1000) && (!helper.choke_requested)) {
+        helper.onChoke(helper.socket, true);
+        helper.choke_requested=true;
+    }
+}
+
+ssize_t socketmultiplex::awrite(int socket, const void *data, size_t size, bool block) {
+    socket_helper * helper = find_connection(socket);
+    if(helper == nullptr) {
+        errno=EBADF;
+        return -1;
+    }
+    debugprintf("add %ld bytes to writebuffer on %d", size, socket);
+    helper->writebuffer.insert(helper->writebuffer.end(), (const uint8_t*) data, ((const uint8_t*) data) + size);
+    flush(*helper, block);
+    return size;
+}
+
+uint8_t * socketmultiplex::write_reserve(int socket, size_t count) {
+    socket_helper * helper = find_connection(socket);
+    if(helper == nullptr) {
+        errno=EBADF;
+        return nullptr;
+    }
+    size_t used = helper->writebuffer.size();
+    helper->writebuffer.resize(used + count);
+    return helper->writebuffer.data() + used;
+}
+
+ssize_t socketmultiplex::write_commit(int socket, size_t count, size_t used, bool block) {
+    socket_helper * helper = find_connection(socket);
+    if(helper == nullptr) {
+        errno=EBADF;
+        return -1;
+    }
+    helper->writebuffer.resize(helper->writebuffer.size() - (count - used));
+    if(used > 0)
+        flush(*helper, block);
+    return used;
+}
+
+bool socketmultiplex::send_shared(int socket, std::shared_ptr<const std::string> data) {
+    socket_helper * helper = find_connection(socket);
+    if(helper == nullptr) {
+        errno=EBADF;
+        return false;
+    }
+    if(data->empty())
+        return true;
+    file_segment segment;
+    segment.data = data->data();
+    segment.length = data->size();
+    segment.after = helper->writebuffer.size();
+    segment.keep = data;
+    helper->files.push_back(segment);
+    flush(*helper, false);
+    return true;
+}
+
+bool socketmultiplex::send_file(int socket, int fd, off_t offset, size_t length, std::shared_ptr<void> keep) {
+    socket_helper * helper = find_connection(socket);
+    if(helper == nullptr) {
+        errno=EBADF;
+        return false;
+    }
+    if(m_io.find(socket) != m_io.end()) {
+        //Data has to pass the I/O hooks, sendfile() would skip them
+        size_t used = helper->writebuffer.size();
+        helper->writebuffer.resize(used + length);
+        if(pread(fd, helper->writebuffer.data() + used, length, offset) != (ssize_t) length) {
+            helper->writebuffer.resize(used);
+            return false;
         }
+    } else {
+        file_segment file;
+        file.fd = fd;
+        file.offset = offset;
+        file.length = length;
+        file.after = helper->writebuffer.size();
+        file.keep = keep;
+        helper->files.push_back(file);
     }
-    errno=EBADF;
-    return -1;
+    flush(*helper, false);
+    return true;
+}
+
+void socketmultiplex::pause(int socket, uint64_t usec) {
+    socket_helper * helper = find_connection(socket);
+    if(helper != nullptr)
+        helper->paused_until = monotonic_usec() + usec;
+}
+
+void socketmultiplex::wake(int socket, uint64_t usec) {
+    socket_helper * helper = find_connection(socket);
+    if(helper != nullptr)
+        helper->wake_at = monotonic_usec() + usec;
+}
+
+void socketmultiplex::want_write(int socket, bool enable) {
+    socket_helper * helper = find_connection(socket);
+    if(helper != nullptr)
+        helper->want_write = enable;
 }
 
 void socketmultiplex::choke(int socket, bool enable) {
@@ -361,6 +591,13 @@ void socketmultiplex::handle_sockets(struct timeval tv) {
 
         FD_SET(helper.socket, &write_fds);
     }
+    //Work posted from other threads
+    if(m_post_pipe[0] >= 0) {
+        if(maxfd <= m_post_pipe[0])
+            maxfd = m_post_pipe[0] +1;
+
+        FD_SET(m_post_pipe[0], &read_fds);
+    }
     //Add listen sockets to select
     for(auto& helper: listener) {
         if(maxfd <= helper.socket)
@@ -369,25 +606,61 @@ void socketmultiplex::handle_sockets(struct timeval tv) {
         FD_SET(helper.socket, &read_fds);
     }
 
-    //Add connection sockets to select
+    //Add connection sockets to select. Paused ones only once their time is up.
+    std::vector<int> buffered{};
+    uint64_t now = monotonic_usec();
     for(auto& helper: connections) {
-        if(!helper.choked) {
+        bool paused = (helper.paused_until > now);
+        if(paused) {
+            uint64_t wait = helper.paused_until - now;
+            if((uint64_t) tv.tv_sec * 1000000 + tv.tv_usec > wait) {
+                tv.tv_sec = wait / 1000000;
+                tv.tv_usec = wait % 1000000;
+            }
+        }
+        if(!helper.choked && !paused) {
             if(maxfd <= helper.socket)
                 maxfd = helper.socket +1;
 
             FD_SET(helper.socket, &read_fds);
+            //Data already decoded in userspace will not wake up select.
+            if(pending(helper.socket) > 0)
+                buffered.push_back(helper.socket);
+        }
+        if(helper.wake_at != 0) {
+            if(helper.wake_at <= now) {
+                helper.wake_at = 0;
+                if(maxfd <= helper.socket)
+                    maxfd = helper.socket +1;
+                buffered.push_back(helper.socket);
+            } else if((uint64_t) tv.tv_sec * 1000000 + tv.tv_usec > helper.wake_at - now) {
+                tv.tv_sec = (helper.wake_at - now) / 1000000;
+                tv.tv_usec = (helper.wake_at - now) % 1000000;
+            }
         }
         //Add write sockets to select
-        if(!helper.writebuffer.empty()) {
-            debugprintf("Something to write on %d", helper.socket);
-            if(maxfd <= helper.socket)
-                maxfd = helper.socket +1;
+        if(!helper.writebuffer.empty() || !helper.files.empty() || helper.want_write) {
+            debugprintf("Something to write on %d", write_fd(helper));
+            if(maxfd <= write_fd(helper))
+                maxfd = write_fd(helper) +1;
 
-            FD_SET(helper.socket, &write_fds);
+            FD_SET(write_fd(helper), &write_fds);
         }
     }
 
+    if(!buffered.empty()) {
+        tv.tv_sec = 0;
+        tv.tv_usec = 0;
+    }
     retval=select(maxfd, &read_fds, &write_fds, NULL, &tv);
+    if(retval >= 0) {
+        for(auto sock: buffered) {
+            if(!FD_ISSET(sock, &read_fds)) {
+                FD_SET(sock, &read_fds);
+                retval ++;
+            }
+        }
+    }
     if(retval == -1) {
         perror("ERROR on select");
     } else if(retval) {
@@ -397,11 +670,13 @@ void socketmultiplex::handle_sockets(struct timeval tv) {
         for(int sock=0; sock < maxfd; sock ++) {
             if(FD_ISSET(sock, &write_fds)) {
                 for(auto& helper: connections) {
-                    if(helper.socket == sock) {
+                    if((write_fd(helper) == sock) && !helper.removed) {
                         debugprintf("Ready to write: %d", sock);
                         if(!try_write(helper)) {
-                            closing.push_back(sock);
+                            closing.push_back(helper.socket);
                         }
+                        if(helper.want_write && !FD_ISSET(helper.socket, &read_fds))
+                            FD_SET(helper.socket, &read_fds);
                         if((helper.writebuffer.size()<= 1000) && (helper.choke_requested)) {
                             helper.onChoke(helper.socket, false);
                             helper.choke_requested=false;
@@ -440,20 +715,24 @@ void socketmultiplex::handle_sockets(struct timeval tv) {
         for(int sock=0; sock < maxfd; sock ++) {
             if(FD_ISSET(sock, &read_fds)) {
                 for(auto& helper: connections) {
-                    if(helper.socket == sock) {
+                    if((helper.socket == sock) && !helper.removed) {
                         //debugprintf("Socket ready to read.");
-                        if(!helper.f(helper.socket)) {
-                            closing.push_back(helper.socket);
+                        if(!helper.f(sock)) {
+                            closing.push_back(sock);
                         }
                         break;
                     }
                 }
             }
         }
+        m_processing_connections=false;
+        for(auto sock: m_removed) {
+            remove_socket_callback(sock);
+        }
+        m_removed.clear();
         for(auto sock: closing) {
             remove_socket_callback(sock);
         }
-        m_processing_connections=false;
         m_processing_listener=true;
         closing.clear();
 
@@ -480,6 +759,10 @@ void socketmultiplex::handle_sockets(struct timeval tv) {
             }
         }
         m_processing_listener=false;
+
+        if((m_post_pipe[0] >= 0) && FD_ISSET(m_post_pipe[0], &read_fds)) {
+            run_posted();
+        }
     } else {
 //        debugprintf("Timeout");
     }
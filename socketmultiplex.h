@@ -19,8 +19,13 @@
 #ifndef __LIBSOCKETMULTIPLEX_H
 #define __LIBSOCKETMULTIPLEX_H
 #include <stdint.h>
+#include <memory>
+#include <string>
 #include <vector>
+#include <list>
+#include <map>
 #include <functional>
+#include <mutex>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -34,13 +39,54 @@ struct listener_helper {
     uint16_t listen_port;
 };
 
+//Leaves new elements uninitialized on resize, so buffer space can be handed out without clearing it first.
+template<typename T>
+struct uninitialized_allocator : std::allocator<T> {
+    template<typename U> struct rebind {
+        using other = uninitialized_allocator<U>;
+    };
+    using std::allocator<T>::allocator;
+    template<typename U> void construct(U * p) {
+        ::new((void*) p) U;
+    }
+    template<typename U, typename... Args> void construct(U * p, Args&&... args) {
+        ::new((void*) p) U(std::forward<Args>(args)...);
+    }
+};
+
+typedef std::vector<uint8_t, uninitialized_allocator<uint8_t>> write_buffer;
+
+//Part of a file to be sent with sendfile() once the first "after" bytes of the write buffer are out.
+//Or part of a buffer other sockets send as well, then data is set instead of fd.
+struct file_segment {
+    int fd{-1};
+    const char * data{nullptr};
+    off_t offset{0};
+    size_t length{0};
+    size_t after{0};
+    std::shared_ptr<const void> keep{}; //whatever owns fd or data
+};
+
 struct socket_helper {
     std::function<bool(int socket)> f{};
     std::function<void(int socket, bool enabled)> onChoke{};
     int socket{0};
-    std::vector<uint8_t> writebuffer{};
+    int write_socket{-1}; //-1: write to socket. Otherwise split read/write fds, e.g. stdin/stdout
+    write_buffer writebuffer{};
+    std::vector<file_segment> files{};
     bool choked{false};
     bool choke_requested{false};
+    uint64_t paused_until{0}; //monotonic usec, not read before (shaping)
+    uint64_t wake_at{0}; //monotonic usec, callback runs then even without data
+    bool want_write{false}; //callback also runs once the socket is writable
+    bool removed{false}; //removed while processing, erased after the current pass
+};
+
+//Optional replacement for read()/write() on a socket, e.g. for userspace encryption.
+struct socket_io {
+    std::function<ssize_t(int socket, void *buf, size_t count)> read{};
+    std::function<ssize_t(int socket, const void *buf, size_t count)> write{};
+    std::function<size_t(int socket)> pending{};
 };
 
 class socketmultiplex {
@@ -52,19 +98,51 @@ public:
 
     int add_port_listener(uint16_t listen_port, std::function<void(int socket)> f);
     void remove_port_listener(uint16_t listen_port);
-    int register_socket_callback(int socket, std::function<bool(int socket)> f);
+    int register_socket_callback(int socket, std::function<bool(int socket)> f, int write_socket=-1);
     void remove_socket_callback(int socket);
     void add_socket_choke(uint16_t socket, std::function<void(int socket, bool enabled)> onChoke);
 
+    void set_socket_io(int socket, socket_io io);
+    ssize_t aread(int socket, void *buf, size_t count);
     ssize_t awrite(int socket, const void *buf, size_t count, bool block=false);
+    //Space for count bytes at the end of the write buffer. Fill it, then hand it to write_commit()
+    //before anything else is written to the socket.
+    uint8_t * write_reserve(int socket, size_t count);
+    ssize_t write_commit(int socket, size_t count, size_t used, bool block=false);
+    //Queue length bytes of fd after what is written so far. keep holds fd open until they are sent.
+    bool send_file(int socket, int fd, off_t offset, size_t length, std::shared_ptr<void> keep);
+    //Queue data after what is written so far, without a copy. Any number of sockets may send the same data.
+    bool send_shared(int socket, std::shared_ptr<const std::string> data);
     void choke(int socket, bool enable);
+    //Don't read socket for usec microseconds. Independent of choke().
+    void pause(int socket, uint64_t usec);
+    //Run the callback of socket in usec microseconds, whether data arrived or not.
+    void wake(int socket, uint64_t usec);
+    //Run the callback of socket as well once it is writable, e.g. a handshake blocked on a full send buffer.
+    void want_write(int socket, bool enable);
+
+    //Thread safe: run f inside the next handle_sockets() of this multiplexer
+    void post(std::function<void(void)> f);
 
     void handle_sockets(struct timeval tv);
 private:
+    void run_posted();
     void remove_attempt(int socket);
+    bool try_write(socket_helper &helper);
+    ssize_t write_buffered(socket_helper &helper, size_t size);
+    ssize_t write_file(socket_helper &helper);
+    void flush(socket_helper &helper, bool block);
+    socket_helper * find_connection(int socket);
+    size_t pending(int socket);
     std::vector<listener_helper> listener;
-    std::vector<socket_helper> connections;
+    //list: callbacks may add connections while an other one is executed
+    std::list<socket_helper> connections;
+    std::vector<int> m_removed;
     std::vector<socket_helper> attempts;
+    std::map<int, socket_io> m_io;
+    std::mutex m_post_lock;
+    std::vector<std::function<void(void)>> m_posted;
+    int m_post_pipe[2] {-1, -1};
     bool m_processing_listener{false};
     bool m_processing_connections{false};
     bool m_processing_attempts{false};
@@ -82,12 +82,13 @@ ssdp::~ssdp() {
 }
 
 ssdp_type ssdp::parse_message(const char *message, int message_size,  ssdp_peer * peer) {
-    char * line = nullptr;
-    int line_length = 0;
+    std::string_view view{};
     int pos=0;
     int n;
     std::string temp;
-    while((n=read_line( &line, &line_length, message + pos, message_size - pos)) > 0) {
+    while((n=read_line_view( &view, message + pos, message_size - pos)) > 0) {
+        const char * line = view.data();
+        int line_length = view.size();
         if(line_length == 0) {
             debugprintf("Got empty line");
 
@@ -113,11 +114,10 @@ ssdp_type ssdp::parse_message(const char *message, int message_size,  ssdp_peer
                                                     if(!parse_token("MX", line, line_length, &(peer->MX)))
                                                         if(!parse_token("CONTENT-LENGTH", line, line_length, &(peer->Content_Length)))
                                                             if(!parse_token("USER-AGENT", line, line_length, &(peer->USER_AGENT))) {
-                                                                debugprintf("UNABLE To PARSE %s", line);
-                                                                peer->unknown += (std::string(line) + SSDP_NL);
+                                                                debugprintf("UNABLE To PARSE %.*s", line_length, line);
+                                                                peer->unknown += (std::string(view) + SSDP_NL);
                                                             }
 
-        free(line);
         pos +=n;
     }
     peer->raw = std::string(message);
@@ -0,0 +1,226 @@
+/*
+ * dlnatunnel
+ * Copyright (C) 2023 Stefan Wildemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ssdp_hub.h"
+#include "ssdp.h"
+#include "stringtoken.h"
+//#define DEBUG
+#include "debugprintf.h"
+
+#define SSDP_HUB_ADDRESS "239.255.255.250"
+#define SSDP_HUB_PORT 1900
+//Real M-SEARCH on the LAN at most that often. Anything in between is answered from cache.
+#define SSDP_HUB_SEARCH_INTERVAL 60
+//Do not replay the cache twice to the same subscriber within that time
+#define SSDP_HUB_REPLAY_INTERVAL 5
+#define SSDP_HUB_DEFAULT_MAX_AGE 1800
+
+static time_t max_age(const ssdp_peer & peer) {
+    size_t pos = peer.CACHE_CONTROL.find("max-age");
+    if(pos == std::string::npos)
+        pos = peer.CACHE_CONTROL.find("MAX-AGE");
+    if(pos == std::string::npos)
+        return SSDP_HUB_DEFAULT_MAX_AGE;
+    pos = peer.CACHE_CONTROL.find("=", pos);
+    if(pos == std::string::npos)
+        return SSDP_HUB_DEFAULT_MAX_AGE;
+    return atoi(peer.CACHE_CONTROL.data() + pos + 1);
+}
+
+ssdp_hub::ssdp_hub(socketmultiplex * mx):
+    m_mx{mx} {
+}
+
+ssdp_hub::~ssdp_hub() {
+    if(m_socket >= 0)
+        m_mx->remove_socket_callback(m_socket);
+}
+
+bool ssdp_hub::open() {
+    int result = m_mx->add_udp_mcast_listener(SSDP_HUB_ADDRESS, SSDP_HUB_PORT, [this](int socket) {
+        m_socket = socket;
+        return m_mx->register_socket_callback(socket, [this](int socket) {
+            return receive(socket);
+        }) >= 0;
+    });
+    if(result < 0) {
+        errorprintf("Unable to open shared SSDP listener");
+        m_socket = -1;
+        return false;
+    }
+    return true;
+}
+
+std::string ssdp_hub::make_key(const ssdp_peer & peer) {
+    if(peer.type == SSDP_TYPE_NOTIFY)
+        return peer.USN + std::string("|") + peer.NT;
+    return peer.USN + std::string("|") + peer.ST;
+}
+
+bool ssdp_hub::receive(int socket) {
+    char buffer[4096];
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    ssize_t n = recvfrom(socket, buffer, sizeof(buffer) - 1, 0, (struct sockaddr *)&addr, &addr_len);
+    if(n <= 0) {
+        errorprintf("Shared SSDP listener died");
+        m_socket = -1;
+        return false;
+    }
+    buffer[n] = 0;
+
+    ssdp_peer peer;
+    switch(m_ssdp.parse_message(buffer, n, &peer)) {
+    case SSDP_TYPE_ANSWER:
+    case SSDP_TYPE_NOTIFY:
+        break;
+    default:
+        //Searches of other LAN hosts (and our own) are of no interest for the clients.
+        return true;
+    }
+
+    auto message = std::make_shared<const std::string>(buffer, n);
+    std::vector<std::pair<int, socketmultiplex*>> targets{};
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        std::string key = make_key(peer);
+        if((peer.type == SSDP_TYPE_NOTIFY) && (peer.NTS.compare("ssdp:byebye") == 0)) {
+            //Answers to searches were cached under the same USN, with ST instead of NT. They are gone as well.
+            std::string usn = peer.USN + std::string("|");
+            auto entry = m_cache.lower_bound(usn);
+            while((entry != m_cache.end()) && (entry->first.compare(0, usn.size(), usn) == 0))
+                entry = m_cache.erase(entry);
+        } else {
+            ssdp_hub_entry entry;
+            entry.message = message;
+            entry.expires = time(nullptr) + max_age(peer);
+            m_cache[key] = entry;
+        }
+        for(auto& subscriber: m_subscribers) {
+            targets.push_back({subscriber.first, subscriber.second.mx});
+        }
+    }
+    debugprintf("Fan out SSDP message to %ld tunnels", targets.size());
+    for(auto& target: targets) {
+        int id = target.first;
+        target.second->post([this, id, message]() {
+            deliver(id, message);
+        });
+    }
+    return true;
+}
+
+// Runs in the subscribers thread
+void ssdp_hub::deliver(int id, std::shared_ptr<const std::string> message) {
+    std::function<void(std::shared_ptr<const std::string> message)> f{};
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        auto subscriber = m_subscribers.find(id);
+        if(subscriber == m_subscribers.end()) {
+            //unsubscribed meanwhile
+            return;
+        }
+        f = subscriber->second.f;
+    }
+    f(message);
+}
+
+int ssdp_hub::subscribe(socketmultiplex * mx,
+                        std::function<void(std::shared_ptr<const std::string> message)> f) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    ssdp_hub_subscriber subscriber;
+    subscriber.id = m_next_id++;
+    subscriber.mx = mx;
+    subscriber.f = f;
+    m_subscribers[subscriber.id] = subscriber;
+    debugprintf("SSDP subscriber %d, %ld total", subscriber.id, m_subscribers.size());
+    return subscriber.id;
+}
+
+void ssdp_hub::unsubscribe(int id) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_subscribers.erase(id);
+}
+
+// Runs in the subscribers thread. Hand out everything we know that did not expire yet.
+void ssdp_hub::replay(int id) {
+    std::vector<std::shared_ptr<const std::string>> messages{};
+    std::function<void(std::shared_ptr<const std::string> message)> f{};
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        auto subscriber = m_subscribers.find(id);
+        if(subscriber == m_subscribers.end())
+            return;
+        time_t now = time(nullptr);
+        if(now - subscriber->second.last_replay < SSDP_HUB_REPLAY_INTERVAL)
+            return;
+        subscriber->second.last_replay = now;
+        f = subscriber->second.f;
+        for(auto entry = m_cache.begin(); entry != m_cache.end();) {
+            if(entry->second.expires < now) {
+                entry = m_cache.erase(entry);
+            } else {
+                messages.push_back(entry->second.message);
+                entry ++;
+            }
+        }
+    }
+    debugprintf("Replay %ld cached SSDP messages to %d", messages.size(), id);
+    for(auto& message: messages) {
+        f(message);
+    }
+}
+
+// Message from a tunnel client for the LAN. Searches are rate limited.
+void ssdp_hub::send(int id, const char * message, size_t message_size) {
+    ssdp_peer peer;
+    ssdp parser{}; //m_ssdp belongs to the hubs thread
+    std::string temp(message, message_size);
+    if(parser.parse_message(temp.data(), temp.size(), &peer) == SSDP_TYPE_SEARCH) {
+        replay(id);
+        std::lock_guard<std::mutex> lock(m_lock);
+        time_t now = time(nullptr);
+        if(now - m_last_search < SSDP_HUB_SEARCH_INTERVAL) {
+            debugprintf("Answered M-SEARCH of %d from cache", id);
+            return;
+        }
+        m_last_search = now;
+    }
+    if(m_socket < 0)
+        return;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family=AF_INET;
+    addr.sin_port=htons(SSDP_HUB_PORT);
+    addr.sin_addr.s_addr=inet_addr(SSDP_HUB_ADDRESS);
+    if(sendto(m_socket, message, message_size, 0, (struct sockaddr *)&addr, sizeof(addr)) != message_size) {
+        perror("ERROR sending SSDP message");
+    }
+}
@@ -0,0 +1,72 @@
+/*
+ * dlnatunnel
+ * Copyright (C) 2023 Stefan Wildemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __SSDP_HUB_H
+#define __SSDP_HUB_H
+#include <time.h>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "socketmultiplex.h"
+#include "ssdp.h"
+
+struct ssdp_hub_entry {
+    std::shared_ptr<const std::string> message{};
+    time_t expires{0};
+};
+
+struct ssdp_hub_subscriber {
+    int id{0};
+    socketmultiplex * mx{nullptr};
+    std::function<void(std::shared_ptr<const std::string> message)> f{};
+    time_t last_replay{0};
+};
+
+/* One SSDP multicast listener shared by all tunnels of the server. Every datagram is parsed
+ * once, kept in a cache and handed to all subscribers as the same reference counted buffer.
+ * Searches of new subscribers are answered from the cache instead of the LAN as long as the
+ * last real M-SEARCH is recent. Subscribers may live in other threads: their callback is
+ * always run inside their own socketmultiplex. */
+class ssdp_hub {
+public:
+    ssdp_hub(socketmultiplex * mx);
+    ~ssdp_hub();
+
+    bool open();
+    int subscribe(socketmultiplex * mx, std::function<void(std::shared_ptr<const std::string> message)> f);
+    void unsubscribe(int id);
+    void replay(int id);
+    void send(int id, const char * message, size_t message_size);
+private:
+    bool receive(int socket);
+    void deliver(int id, std::shared_ptr<const std::string> message);
+    std::string make_key(const ssdp_peer & peer);
+    socketmultiplex * m_mx;
+    std::atomic<int> m_socket{-1};
+    ssdp m_ssdp{};
+    std::mutex m_lock{};
+    int m_next_id{1};
+    time_t m_last_search{0};
+    std::map<std::string, ssdp_hub_entry> m_cache{};
+    std::map<int, ssdp_hub_subscriber> m_subscribers{};
+};
+
+#endif
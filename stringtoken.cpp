@@ -24,6 +24,10 @@
 #include <stdbool.h>
 #include <string>
 #include <regex>
+#include <string_view>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "stringtoken.h"
 #include "debugprintf.h"
@@ -71,6 +75,59 @@ int read_line( char** buffer, int* size, const char* input, size_t input_size, b
     return pos;
 }
 
+//Position of the first LF or NUL, size if there is none.
+static size_t find_line_end(const char* input, size_t input_size) {
+    size_t pos = 0;
+#if defined(__AVX2__)
+    const __m256i lf32 = _mm256_set1_epi8('\n');
+    const __m256i nul32 = _mm256_setzero_si256();
+    for(; pos + 32 <= input_size; pos += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(input + pos));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, lf32),
+                        _mm256_cmpeq_epi8(chunk, nul32)));
+        if(mask != 0)
+            return pos + __builtin_ctz(mask);
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i lf16 = _mm_set1_epi8('\n');
+    const __m128i nul16 = _mm_setzero_si128();
+    for(; pos + 16 <= input_size; pos += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(input + pos));
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, lf16),
+                        _mm_cmpeq_epi8(chunk, nul16)));
+        if(mask != 0)
+            return pos + __builtin_ctz(mask);
+    }
+#endif
+    for(; pos < input_size; pos++) {
+        if((input[pos] == '\n') || (input[pos] == 0))
+            break;
+    }
+    return pos;
+}
+
+/* Like read_line, but line points into input instead of a malloced copy. CRs are only
+ * removed at the end of the line, a CR in the middle of a line is kept. */
+size_t read_line_view(std::string_view* line, const char* input, size_t input_size, bool* have_newline) {
+    if(have_newline != nullptr)
+        *have_newline = false;
+    if(input == nullptr) {
+        *line = std::string_view{};
+        return 0;
+    }
+    size_t end = find_line_end(input, input_size);
+    size_t length = end;
+    while((length > 0) && (input[length - 1] == '\r'))
+        length --;
+    *line = std::string_view(input, length);
+    if(end == input_size)
+        return end;
+    if((input[end] == '\n') && (have_newline != nullptr))
+        *have_newline = true;
+    return end + 1;
+}
+
 int read_token( char* buffer, int* size, const char* string, const int stringsize ) {
     int max = *size;
     ( *size ) = 0;
@@ -78,11 +135,11 @@ int read_token( char* buffer, int* size, const char* string, const int stringsiz
     int a = 0;
 
     //Skip leading spaces;
-    while( ( ( string[a] == ' ' ) || ( string[a] == '\t' ) ) && ( a < stringsize ) ) {
+    while( ( a < stringsize ) && ( ( string[a] == ' ' ) || ( string[a] == '\t' ) ) ) {
         a++;
     }
 
-    while( ( ( string[a] != ' ' ) && ( string[a] != '\t' ) && (string[a] != ':'))  && ( a < stringsize )
+    while( ( a < stringsize ) && ( ( string[a] != ' ' ) && ( string[a] != '\t' ) && (string[a] != ':'))
             && ( ( *size ) < max ) ) {
         buffer[( *size )] = string[a];
         buffer[( *size ) + 1] = 0;
@@ -91,7 +148,7 @@ int read_token( char* buffer, int* size, const char* string, const int stringsiz
     }
 
     //Skip trailing spaces for next token;
-    while( ( ( string[a] == ' ' ) || ( string[a] == '\t' ) || (string[a] == ':') ) && ( a < stringsize ) ) {
+    while( ( a < stringsize ) && ( ( string[a] == ' ' ) || ( string[a] == '\t' ) || (string[a] == ':') ) ) {
         a++;
     }
 
@@ -103,7 +160,7 @@ bool parse_token(const char * find_token, const char * line, int line_length, st
     int left = line_length;
     int n;
     char token[255];
-    int tokensize=sizeof(token);
+    int tokensize=sizeof(token) - 1;
     n = read_token(token,  &tokensize, pos, left);
     if(tokensize > 0) {
         for(int a = 0; a < tokensize; a++)
@@ -111,7 +168,8 @@ bool parse_token(const char * find_token, const char * line, int line_length, st
         if(strcmp(token, find_token) == 0) {
             pos += n;
             left -= n;
-            (*string)=std::string(pos);
+            //line is not terminated, it may point into the received data
+            (*string)=std::string(pos, left);
             return true;
         }
     }
@@ -122,24 +180,20 @@ std::string do_replace_case( std::string const & in, std::string const & from, s
     return std::regex_replace( in.data(), std::regex(from, std::regex_constants::icase), to.data());
 }
 
-bool iequals(const std::string& a, const std::string& b) {
+bool iequals(std::string_view a, std::string_view b) {
     return std::equal(a.begin(), a.end(),
                       b.begin(), b.end(),
     [](char a, char b) {
-        return std::tolower(a) == std::tolower(b);
+        return ascii_lower(a) == ascii_lower(b);
     });
 }
 
-bool icontains(const std::string& a, const std::string& b) {
-    std::string low_a;
-    std::string low_b;
-    for(char x: a)
-        low_a += std::tolower(x);
-
-    for(char x: b)
-        low_b += std::tolower(x);
-    if (low_a.find(low_b) != std::string::npos) {
-        return true;
+bool icontains(std::string_view a, std::string_view b) {
+    if(b.size() > a.size())
+        return false;
+    for(size_t pos = 0; pos + b.size() <= a.size(); pos++) {
+        if(iequals(a.substr(pos, b.size()), b))
+            return true;
     }
     return false;
 }
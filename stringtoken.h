@@ -23,17 +23,25 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string>
+#include <string_view>
 
 int read_line( char** buffer, int* size, const char* input, size_t input_size, bool* have_newline=nullptr);
 
+size_t read_line_view(std::string_view* line, const char* input, size_t input_size, bool* have_newline=nullptr);
+
 int read_token( char* buffer, int* size, const char* string, const int stringsize );
 
 bool parse_token(const char * find_token, const char * line, int line_length, std::string * string);
 
 std::string do_replace_case( std::string const & in, std::string const & from, std::string const & to );
 
-bool iequals(const std::string& a, const std::string& b);
-bool icontains(const std::string& a, const std::string& b);
+//Lower case for ASCII letters only. Other bytes, e.g. parts of UTF-8 sequences, stay as they are.
+inline char ascii_lower(char c) {
+    return ((c >= 'A') && (c <= 'Z')) ? (char)(c - 'A' + 'a') : c;
+}
+
+bool iequals(std::string_view a, std::string_view b);
+bool icontains(std::string_view a, std::string_view b);
 
 #endif
 
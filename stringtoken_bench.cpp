@@ -0,0 +1,83 @@
+/*
+ * dlnatunnel
+ * Copyright (C) 2023 Stefan Wildemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Compares read_line with read_line_view on typical header data.
+ * Build with "cmake --build . --target stringtoken_bench". */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <string_view>
+
+#include "stringtoken.h"
+
+const char header[] = {
+    "HTTP/1.1 200 OK\r\n"
+    "DATE: Wed, 10 May 2023 11:39:51 GMT\r\n"
+    "SERVER: FRITZ!Box 7490 (UI) UPnP/1.0 AVM FRITZ!Box 7490 (UI) 113.07.29\r\n"
+    "CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
+    "TRANSFER-ENCODING: chunked\r\n"
+    "CACHE-CONTROL: max-age=1800\r\n"
+    "LOCATION: http://192.168.178.1:49000/MediaServerDevDesc.xml\r\n"
+    "USN: uuid:fa095ecc-e13e-40e7-8e6c-3ca62f98471f::urn:schemas-upnp-org:device:MediaServer:1\r\n"
+    "\r\n"
+};
+
+template<typename F>
+static void run(const char * name, const std::string & data, int rounds, F f) {
+    size_t lines = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(int a = 0; a < rounds; a++)
+        lines += f(data);
+    std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+    printf("%-16s %8zu lines/round %10.1f MB/s\n", name, lines / rounds, (data.size() * (double) rounds) / took.count() / 1e6);
+}
+
+int main(int argc, char ** argv) {
+    int rounds = (argc > 1) ? atoi(argv[1]) : 2000;
+    std::string data{};
+    while(data.size() < 64 * 1024)
+        data += header;
+
+    run("read_line", data, rounds, [](const std::string & data) {
+        size_t pos = 0;
+        size_t lines = 0;
+        int n;
+        char * line;
+        int line_length;
+        while((n = read_line(&line, &line_length, data.data() + pos, data.size() - pos)) > 0) {
+            lines += (line_length >= 0);
+            free(line);
+            pos += n;
+        }
+        return lines;
+    });
+    run("read_line_view", data, rounds, [](const std::string & data) {
+        size_t pos = 0;
+        size_t lines = 0;
+        size_t n;
+        std::string_view line;
+        while((n = read_line_view(&line, data.data() + pos, data.size() - pos)) > 0) {
+            lines += (line.data() != nullptr);
+            pos += n;
+        }
+        return lines;
+    });
+    return 0;
+}
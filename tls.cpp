@@ -0,0 +1,299 @@
+/*
+ * dlnatunnel
+ * Copyright (C) 2023 Stefan Wildemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <memory>
+#include <string>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509v3.h>
+
+#include "tls.h"
+#include "socketmultiplex.h"
+#include "token_bucket.h"
+//#define DEBUG
+#include "debugprintf.h"
+
+//TLS 1.3 external PSKs must use a SHA256 suite. AES-GCM is what the kernel can offload.
+#define TLS_CIPHERSUITES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384"
+#define TLS_PSK_CIPHERSUITES "TLS_AES_128_GCM_SHA256"
+#define TLS_HANDSHAKE_TIMEOUT 10
+
+bool tls_config::enabled() const {
+    return !psk_file.empty() || !cert_file.empty() || !ca_file.empty();
+}
+
+static void print_ssl_errors(const char * what) {
+    unsigned long e;
+    errorprintf("%s failed", what);
+    while((e = ERR_get_error()) != 0) {
+        char buffer[256];
+        ERR_error_string_n(e, buffer, sizeof(buffer));
+        errorprintf("%s", buffer);
+    }
+}
+
+static tls_context * get_context(SSL * ssl) {
+    return (tls_context *) SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+}
+
+static unsigned int psk_client_cb(SSL *ssl, const char *hint, char *identity, unsigned int max_identity_len,
+                                  unsigned char *psk, unsigned int max_psk_len) {
+    tls_context * ctx = get_context(ssl);
+    if((ctx->psk_identity().size() + 1 > max_identity_len) || (ctx->psk().size() > max_psk_len))
+        return 0;
+    strcpy(identity, ctx->psk_identity().data());
+    memcpy(psk, ctx->psk().data(), ctx->psk().size());
+    return ctx->psk().size();
+}
+
+static unsigned int psk_server_cb(SSL *ssl, const char *identity, unsigned char *psk, unsigned int max_psk_len) {
+    tls_context * ctx = get_context(ssl);
+    if((identity == nullptr) || (ctx->psk_identity().compare(identity) != 0)) {
+        errorprintf("Unknown PSK identity %s", (identity == nullptr) ? "(null)" : identity);
+        return 0;
+    }
+    if(ctx->psk().size() > max_psk_len)
+        return 0;
+    memcpy(psk, ctx->psk().data(), ctx->psk().size());
+    return ctx->psk().size();
+}
+
+static ssize_t ssl_result(SSL * ssl, int n) {
+    if(n > 0)
+        return n;
+    switch(SSL_get_error(ssl, n)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    default:
+        print_ssl_errors("TLS I/O");
+        errno = EIO;
+        return -1;
+    }
+}
+
+//Handshake is done. Leave the records to the kernel if it can, otherwise run them through OpenSSL.
+static void use_ssl(socketmultiplex * mx, int socket, std::shared_ptr<SSL> ssl) {
+    bool ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl.get()));
+    bool ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(ssl.get()));
+    fprintf(stderr, "TLS %s established (%s), kernel offload send:%s receive:%s\n", SSL_get_version(ssl.get()),
+            SSL_get_cipher(ssl.get()), ktls_send ? "yes" : "no", ktls_recv ? "yes" : "no");
+    if(ktls_send && ktls_recv) {
+        //Kernel does all the work. mplex reads and writes plain text on the socket.
+        return;
+    }
+
+    socket_io io;
+    io.read = [ssl](int socket, void * buf, size_t count) {
+        size_t total = 0;
+        //Drain as much as fits, so nothing gets stuck inside the SSL buffers unnoticed.
+        while(total < count) {
+            int n = SSL_read(ssl.get(), ((uint8_t*) buf) + total, count - total);
+            if(n <= 0) {
+                if(total > 0)
+                    return (ssize_t) total;
+                return ssl_result(ssl.get(), n);
+            }
+            total += n;
+        }
+        return (ssize_t) total;
+    };
+    io.write = [ssl](int socket, const void * buf, size_t count) {
+        return ssl_result(ssl.get(), SSL_write(ssl.get(), buf, count));
+    };
+    io.pending = [ssl](int socket) {
+        return (size_t) SSL_pending(ssl.get());
+    };
+    mx->set_socket_io(socket, io);
+}
+
+tls_context::tls_context(const tls_config& config, bool server):
+    m_config{config},
+    m_server{server} {
+    m_ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+    if(m_ctx == nullptr) {
+        print_ssl_errors("SSL_CTX_new");
+        return;
+    }
+    SSL_CTX_set_app_data(m_ctx, this);
+    SSL_CTX_set_min_proto_version(m_ctx, TLS1_3_VERSION);
+    SSL_CTX_set_options(m_ctx, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_mode(m_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    //Session tickets would arrive as non-data records on the kernel socket. We never resume anyway.
+    SSL_CTX_set_num_tickets(m_ctx, 0);
+    SSL_CTX_set_ciphersuites(m_ctx, TLS_CIPHERSUITES);
+
+    if(!m_config.psk_file.empty() && !setup_psk()) {
+        SSL_CTX_free(m_ctx);
+        m_ctx = nullptr;
+        return;
+    }
+    if((!m_config.cert_file.empty() || !m_config.ca_file.empty()) && !setup_certificates()) {
+        SSL_CTX_free(m_ctx);
+        m_ctx = nullptr;
+        return;
+    }
+}
+
+tls_context::~tls_context() {
+    if(m_ctx != nullptr)
+        SSL_CTX_free(m_ctx);
+}
+
+bool tls_context::valid() {
+    return m_ctx != nullptr;
+}
+
+const std::string& tls_context::psk() const {
+    return m_psk;
+}
+
+const std::string& tls_context::psk_identity() const {
+    return m_config.psk_identity;
+}
+
+bool tls_context::setup_psk() {
+    FILE * fp = fopen(m_config.psk_file.data(), "r");
+    if(fp == nullptr) {
+        perror("ERROR opening PSK file");
+        return false;
+    }
+    std::string secret{};
+    char buffer[256];
+    size_t n;
+    while((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        secret.append(buffer, n);
+    }
+    fclose(fp);
+    //Ignore trailing newlines, so "echo secret > file" works on both ends
+    while(!secret.empty() && ((secret.back() == '\n') || (secret.back() == '\r')))
+        secret.pop_back();
+    if(secret.empty()) {
+        errorprintf("PSK file %s is empty", m_config.psk_file.data());
+        return false;
+    }
+    //Derive a fixed size key from whatever the user put into the file
+    unsigned char key[EVP_MAX_MD_SIZE];
+    unsigned int key_length = 0;
+    if(!EVP_Digest(secret.data(), secret.size(), key, &key_length, EVP_sha256(), nullptr)) {
+        print_ssl_errors("PSK digest");
+        return false;
+    }
+    m_psk = std::string((char*) key, key_length);
+    SSL_CTX_set_ciphersuites(m_ctx, TLS_PSK_CIPHERSUITES);
+    if(m_server)
+        SSL_CTX_set_psk_server_callback(m_ctx, psk_server_cb);
+    else
+        SSL_CTX_set_psk_client_callback(m_ctx, psk_client_cb);
+    return true;
+}
+
+bool tls_context::setup_certificates() {
+    if(!m_config.cert_file.empty()) {
+        if(SSL_CTX_use_certificate_chain_file(m_ctx, m_config.cert_file.data()) != 1) {
+            print_ssl_errors("Loading certificate");
+            return false;
+        }
+        const std::string& key = m_config.key_file.empty() ? m_config.cert_file : m_config.key_file;
+        if(SSL_CTX_use_PrivateKey_file(m_ctx, key.data(), SSL_FILETYPE_PEM) != 1) {
+            print_ssl_errors("Loading private key");
+            return false;
+        }
+    }
+    if(!m_config.ca_file.empty()) {
+        if(SSL_CTX_load_verify_locations(m_ctx, m_config.ca_file.data(), nullptr) != 1) {
+            print_ssl_errors("Loading CA");
+            return false;
+        }
+    } else if(!m_server && (SSL_CTX_set_default_verify_paths(m_ctx) != 1)) {
+        print_ssl_errors("Loading system CAs");
+        return false;
+    }
+    //Server side a CA means: only accept clients with certificates signed by it.
+    //The client always checks the server, otherwise anybody in between could answer instead.
+    if(m_server && !m_config.ca_file.empty())
+        SSL_CTX_set_verify(m_ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, nullptr);
+    else if(!m_server)
+        SSL_CTX_set_verify(m_ctx, SSL_VERIFY_PEER, nullptr);
+    return true;
+}
+
+bool tls_context::secure(socketmultiplex * mx, int socket, std::function<void(int socket, bool ok)> done,
+                         const char * peer_host) {
+    if(m_ctx == nullptr)
+        return false;
+    std::shared_ptr<SSL> ssl(SSL_new(m_ctx), SSL_free);
+    if(!ssl) {
+        print_ssl_errors("SSL_new");
+        return false;
+    }
+    SSL_set_fd(ssl.get(), socket);
+    if(m_server)
+        SSL_set_accept_state(ssl.get());
+    else
+        SSL_set_connect_state(ssl.get());
+    if(!m_server && (peer_host != nullptr)) {
+        //Check the name the user asked for. Numeric hosts have to be in the certificate as IP address.
+        if(X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl.get()), peer_host) != 1)
+            SSL_set1_host(ssl.get(), peer_host);
+    }
+
+    //The handshake runs from the event loop, so a stalled peer only delays its own tunnel.
+    uint64_t deadline = monotonic_usec() + TLS_HANDSHAKE_TIMEOUT * 1000000ULL;
+    mx->register_socket_callback(socket, [mx, ssl, done, deadline](int socket) {
+        if(SSL_is_init_finished(ssl.get()))
+            return true; //done() not run yet
+        int n = SSL_do_handshake(ssl.get());
+        if(n == 1) {
+            mx->want_write(socket, false);
+            use_ssl(mx, socket, ssl);
+            //done() may register its own callback for the socket, which must not happen from inside this one.
+            mx->choke(socket, true);
+            mx->post([done, socket]() {
+                done(socket, true);
+            });
+            return true;
+        }
+        int error = SSL_get_error(ssl.get(), n);
+        uint64_t now = monotonic_usec();
+        if(((error == SSL_ERROR_WANT_READ) || (error == SSL_ERROR_WANT_WRITE)) && (now < deadline)) {
+            mx->want_write(socket, error == SSL_ERROR_WANT_WRITE);
+            mx->wake(socket, deadline - now);
+            return true;
+        }
+        if(now >= deadline)
+            errorprintf("TLS handshake timed out");
+        else
+            print_ssl_errors("TLS handshake");
+        done(socket, false);
+        return false;
+    });
+    //The client speaks first
+    mx->wake(socket, 0);
+    return true;
+}
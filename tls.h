@@ -0,0 +1,62 @@
+/*
+ * dlnatunnel
+ * Copyright (C) 2023 Stefan Wildemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TLS_H
+#define __TLS_H
+#include <string>
+#include <functional>
+#include "socketmultiplex.h"
+
+typedef struct ssl_ctx_st SSL_CTX;
+
+struct tls_config {
+    std::string psk_file{};
+    std::string psk_identity{"dlnatunnel"};
+    std::string cert_file{};
+    std::string key_file{};
+    std::string ca_file{};
+
+    bool enabled() const;
+};
+
+/* Encrypts the tunnel socket. The TLS 1.3 handshake is done in userspace, afterwards the
+ * traffic keys are handed to the kernel (TCP_ULP "tls") so mplex keeps using plain read()
+ * and write() on the socket. If the kernel has no TLS support the records are processed
+ * in userspace using the socketmultiplex I/O hooks instead. */
+class tls_context {
+public:
+    tls_context(const tls_config& config, bool server);
+    ~tls_context();
+
+    bool valid();
+    //Runs the handshake on socket from the event loop of mx. done(socket, true) is posted once it is
+    //encrypted, the socket stays choked until then. On done(socket, false) mx has closed the socket.
+    bool secure(socketmultiplex * mx, int socket, std::function<void(int socket, bool ok)> done,
+                const char * peer_host=nullptr);
+    const std::string& psk() const;
+    const std::string& psk_identity() const;
+private:
+    bool setup_psk();
+    bool setup_certificates();
+    tls_config m_config;
+    bool m_server;
+    std::string m_psk{};
+    SSL_CTX * m_ctx{nullptr};
+};
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * dlnatunnel
+ * Copyright (C) 2023 Stefan Wildemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <time.h>
+#include "token_bucket.h"
+
+uint64_t monotonic_usec() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+token_bucket::token_bucket(size_t rate, size_t burst):
+    m_rate{(double) rate},
+    m_burst{(double) burst},
+    m_tokens{(double) burst},
+    m_last{monotonic_usec()} {
+}
+
+void token_bucket::refill() {
+    uint64_t now = monotonic_usec();
+    m_tokens += m_rate * (now - m_last) / 1000000;
+    if(m_tokens > m_burst)
+        m_tokens = m_burst;
+    m_last = now;
+}
+
+// Account size bytes. Returns the microseconds until the bucket is out of debt, 0 if it is not.
+uint64_t token_bucket::take(size_t size) {
+    if(m_rate <= 0)
+        return 0;
+    refill();
+    m_tokens -= size;
+    if(m_tokens >= 0)
+        return 0;
+    return (uint64_t) (-m_tokens * 1000000 / m_rate) + 1;
+}
+
+size_t token_bucket::rate() const {
+    return m_rate;
+}
+
+size_t token_bucket::burst() const {
+    return m_burst;
+}
@@ -0,0 +1,43 @@
+/*
+ * dlnatunnel
+ * Copyright (C) 2023 Stefan Wildemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __TOKEN_BUCKET_H
+#define __TOKEN_BUCKET_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* Rate limit in bytes per second. Sending is accounted after the fact: the bucket may go into
+ * debt, take() then tells how long to wait until it is paid off. A rate of 0 means unlimited. */
+class token_bucket {
+public:
+    token_bucket(size_t rate, size_t burst);
+
+    uint64_t take(size_t size);
+    size_t rate() const;
+    size_t burst() const;
+private:
+    void refill();
+    double m_rate;
+    double m_burst;
+    double m_tokens;
+    uint64_t m_last;
+};
+
+//Monotonic clock in microseconds
+uint64_t monotonic_usec();
+
+#endif
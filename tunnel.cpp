@@ -21,6 +21,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <memory>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "mplex.h"
 #include "socketmultiplex.h"
 #include "tunnel_filter.h"
@@ -29,6 +34,19 @@
 
 #define TUNNEL_CONNECT_REASON_FORWARD 1
 #define TUNNEL_CONNECT_REASON_MCAST_FORWARD 2
+#define TUNNEL_READ_AHEAD_MIN (64 * 1024)
+//Unsent data the kernel may hold for the tunnel. The rest waits where a reset can still drop it.
+#define TUNNEL_NOTSENT_LOWAT (128 * 1024)
+//Channels that sent more than this are bulk (media) and wait for the rate limits. Others never wait.
+#define TUNNEL_BULK_BYTES (1024 * 1024)
+//Bucket size: 50ms at the configured rate, at least this
+#define TUNNEL_BURST_MIN (16 * 1024)
+//Seconds a freed local port rests before it is handed out again. Clients may still have URLs with it.
+#define TUNNEL_PORT_QUARANTINE 3600
+//Warm channels per target, and how long accepts count and unused channels are kept (seconds)
+#define TUNNEL_WARM_MAX 4
+#define TUNNEL_WARM_WINDOW 10
+#define TUNNEL_WARM_TIMEOUT 5
 #pragma pack(push,1)
 struct tunnel_connect_reason {
     uint8_t reason{0};
@@ -42,6 +60,9 @@ tunnel::tunnel(socketmultiplex * mx, int socket, std::function<void(tunnel* tn)>
     m_mx{mx},
     m_socket{socket},
     m_on_ready{on_ready} {
+    //Fails on pipes and unix sockets, they have no such queue
+    int lowat = TUNNEL_NOTSENT_LOWAT;
+    setsockopt(socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
 };
 
 tunnel::~tunnel() {
@@ -70,71 +91,42 @@ bool tunnel::on_mplex_connect(mplex * mpx, uint32_t channel, void* reason, uint8
         debugprintf( "Malformed reason");
         return false;
     }
+    if((m_max_channels > 0) && (mpx->endpoint_count() >= m_max_channels)) {
+        errorprintf("Channel limit of %ld reached, reject channel %d", m_max_channels, channel);
+        return false;
+    }
     if(r->reason ==  TUNNEL_CONNECT_REASON_FORWARD) {
         debugprintf("We shall forward to %s:%d", r->host, r->port);
 
+        std::shared_ptr<read_ahead> ra{};
+        if(m_max_read_ahead > 0) {
+            ra = std::make_shared<read_ahead>();
+            m_read_ahead[channel] = ra;
+        }
+        std::shared_ptr<channel_shaper> shaper{};
+        if((m_bucket.rate() > 0) || (m_channel_rate > 0))
+            shaper = std::make_shared<channel_shaper>(m_channel_rate, std::max(m_channel_rate / 20,
+                     (size_t) TUNNEL_BURST_MIN));
+        std::shared_ptr<upstream_connection> up{};
+        if(m_upstream_pool != nullptr) {
+            up = std::make_shared<upstream_connection>(r->host, r->port);
+            int port_socket = m_upstream_pool->take(r->host, r->port);
+            if(port_socket >= 0) {
+                debugprintf("Reuse connection %d", port_socket);
+                return connect_endpoint(channel, port_socket, ra, up, shaper);
+            }
+        }
         //try to connect to remote destination
-        m_mx->connect_port(r->host, r->port, [this, channel] (int port_socket) {
+        m_mx->connect_port(r->host, r->port, [this, channel, ra, up, shaper] (int port_socket) {
             debugprintf("Remote connection open");
-
-            int result = m_mplex->add_endpoint_listener(channel, [this, port_socket](mplex * mpx, mplex_frame * frame) {
-                //Copy everything we get from channel to socket
-                if(frame==nullptr) {
-                    debugprintf("nullptr on endpoint");
-                    m_mx->remove_socket_callback(port_socket);
-                    return false;
-                }
-
-                debugprintf( "EP: Received something on channel %d for socket %d", frame->channel, port_socket);
-                int n=m_mx->awrite(port_socket, frame->payload.raw, frame->payload_size);
-                if( n != frame->payload_size ) {
-                    debugprintf("Error on socket write");
-                    m_mx->remove_socket_callback(port_socket);
-                    return false;
-                } else {
-                    return true;
-                }
-
-            });
-            if(result < 0) {
-                debugprintf("Error on connectiing port");
-                return false;
-            } else {
-                m_mplex->add_endpoint_choke(channel, [this, port_socket](mplex * mpx, uint32_t channel, bool enabled) {
-                    m_mx->choke(port_socket, enabled);
-                });
-            }
-
-            result = m_mx->register_socket_callback(port_socket, [this, channel](int socket) {
-                debugprintf("EP: Received something on socket %d for channel %d", socket, channel);
-                //Copy everythig we receive from socket to channel
-                mplex_frame frame;
-                errno = 0;
-                frame.payload_size = read(socket, frame.payload.raw, sizeof(frame.payload));
-                if((frame.payload_size < 0) || ((frame.payload_size == 0) && (errno != EINPROGRESS))) {
-                    debugprintf("error on read");
-                    m_mplex->remove_endpoint_listener(channel);
-                    return false;
-                }
-                if(frame.payload_size == 0) {
-                    debugprintf("read 0, errno %s", strerror(errno));
-                    //do not send answer in that case. Not EOF
-                    return true;
-                }
-                m_mplex->send_data_response(channel, &frame);
-                return true;
-            });
-            if(result < 0) {
-                debugprintf("error on regitering socket callback");
-                m_mplex->remove_endpoint_listener(channel);
-                return false;
-            } else {
-                m_mx->add_socket_choke(port_socket, [this, channel](int socket, bool enabled) {
-                    m_mplex->send_choke_response(channel, enabled);
-                });
-            }
-            return true;
+            if(m_upstream_pool != nullptr)
+                m_upstream_pool->connected();
+            return connect_endpoint(channel, port_socket, ra, up, shaper);
         });
+    } else if((r->reason == TUNNEL_CONNECT_REASON_MCAST_FORWARD) && (m_ssdp_hub != nullptr)
+              && (strcmp(r->host, "239.255.255.250") == 0) && (r->port == 1900)) {
+        debugprintf("We shall MCAST forward SSDP using shared listener");
+        return connect_ssdp_hub(channel);
     } else if(r->reason == TUNNEL_CONNECT_REASON_MCAST_FORWARD) {
         struct sockaddr_in addr;
         memset(&addr, 0, sizeof(struct sockaddr_in));
@@ -201,6 +193,128 @@ bool tunnel::on_mplex_connect(mplex * mpx, uint32_t channel, void* reason, uint8
     return true;
 }
 
+// Channel and connection to the media server are there, copy between them
+bool tunnel::connect_endpoint(uint32_t channel, int port_socket, std::shared_ptr<read_ahead> ra,
+                              std::shared_ptr<upstream_connection> up, std::shared_ptr<channel_shaper> shaper) {
+    int result = m_mplex->add_endpoint_listener(channel, [this, port_socket, channel, up](mplex * mpx,
+    mplex_frame * frame) {
+        //Copy everything we get from channel to socket
+        if(frame==nullptr) {
+            debugprintf("nullptr on endpoint");
+            release_endpoint(channel, port_socket, up);
+            return false;
+        }
+
+        debugprintf( "EP: Received something on channel %d for socket %d", frame->channel, port_socket);
+        if(up)
+            up->request((const char*) frame->payload.raw, frame->payload_size);
+        int n=m_mx->awrite(port_socket, frame->payload.raw, frame->payload_size);
+        if( n != frame->payload_size ) {
+            debugprintf("Error on socket write");
+            m_read_ahead.erase(channel);
+            m_mx->remove_socket_callback(port_socket);
+            return false;
+        } else {
+            return true;
+        }
+
+    });
+    if(result < 0) {
+        debugprintf("Error on connectiing port");
+        m_read_ahead.erase(channel);
+        m_mx->remove_socket_callback(port_socket);
+        return false;
+    } else {
+        m_mplex->add_endpoint_choke(channel, [this, port_socket, ra, shaper](mplex * mpx, uint32_t channel,
+        bool enabled) {
+            if(ra)
+                choke_read_ahead(channel, port_socket, ra, shaper, enabled);
+            else
+                m_mx->choke(port_socket, enabled);
+        });
+        m_mplex->add_endpoint_reset(channel, [port_socket, ra, up](mplex * mpx, uint32_t channel) {
+            //Nothing in flight: the connection can still go back to the pool
+            if(up && up->reusable())
+                return;
+            //Drop what was read ahead and abort the connection, so the server stops sending too
+            if(ra)
+                ra->buffer.clear();
+            if(up)
+                up->fail();
+            struct linger abort {
+                1, 0
+            };
+            setsockopt(port_socket, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+        });
+    }
+
+    result = m_mx->register_socket_callback(port_socket, [this, channel, ra, up, shaper](int socket) {
+        debugprintf("EP: Received something on socket %d for channel %d", socket, channel);
+        if(ra && ra->choked)
+            return fill_read_ahead(socket, ra, up);
+        //Copy everythig we receive from socket to channel
+        mplex_frame frame;
+        errno = 0;
+        frame.payload_size = read(socket, frame.payload.raw, shaped_read_size(shaper));
+        if((frame.payload_size < 0) || ((frame.payload_size == 0) && (errno != EINPROGRESS))) {
+            debugprintf("error on read");
+            m_read_ahead.erase(channel);
+            m_mplex->remove_endpoint_listener(channel);
+            return false;
+        }
+        if(frame.payload_size == 0) {
+            debugprintf("read 0, errno %s", strerror(errno));
+            //do not send answer in that case. Not EOF
+            return true;
+        }
+        if(up)
+            up->response((const char*) frame.payload.raw, frame.payload_size);
+        m_mplex->send_data_response(channel, &frame);
+        shape(socket, shaper, frame.payload_size);
+        return true;
+    });
+    if(result < 0) {
+        debugprintf("error on regitering socket callback");
+        m_read_ahead.erase(channel);
+        m_mplex->remove_endpoint_listener(channel);
+        return false;
+    } else {
+        m_mx->add_socket_choke(port_socket, [this, channel](int socket, bool enabled) {
+            m_mplex->send_choke_response(channel, enabled);
+        });
+    }
+    return true;
+}
+
+// Client closed the channel. The connection goes back to the pool, if it can be used again.
+void tunnel::release_endpoint(uint32_t channel, int port_socket, std::shared_ptr<upstream_connection> up) {
+    m_read_ahead.erase(channel);
+    if(up)
+        m_upstream_pool->give(*up, port_socket);
+    else
+        m_mx->remove_socket_callback(port_socket);
+}
+
+bool tunnel::connect_ssdp_hub(uint32_t channel) {
+    int id = m_ssdp_hub->subscribe(m_mx, [this, channel](std::shared_ptr<const std::string> message) {
+        m_mplex->send_data_response(channel, message->data(), message->size());
+    });
+    int result = m_mplex->add_endpoint_listener(channel, [this, id](mplex * mpx, mplex_frame * frame) {
+        if(frame==nullptr) {
+            m_ssdp_hub->unsubscribe(id);
+            return false;
+        }
+        m_ssdp_hub->send(id, (const char*) frame->payload.raw, frame->payload_size);
+        return true;
+    });
+    if(result < 0) {
+        m_ssdp_hub->unsubscribe(id);
+        return false;
+    }
+    m_ssdp_hub->replay(id);
+    return true;
+}
+
 int tunnel::open_udp_mcast(const char * target, uint16_t port, std::function<bool(mplex * mpx, uint32_t channel)> f) {
     tunnel_connect_reason reason;
     reason.reason = TUNNEL_CONNECT_REASON_MCAST_FORWARD;
@@ -223,119 +337,541 @@ int tunnel::open_remote(const char * target, uint16_t port, std::function<bool(m
     return m_mplex->open_channel(f, (void*) &reason, sizeof(reason));
 }
 
+// filter, then a meter. Plain connections only get the meter, as a stack it passes everything on inline.
+static std::shared_ptr<tunnel_filter> metered(std::shared_ptr<tunnel_filter> filter, size_t * bytes) {
+    if(!filter)
+        return std::make_shared<tunnel_filter_stack<tunnel_meter>>(tunnel_meter{bytes});
+    std::shared_ptr<tunnel_filter_chain> chain = std::make_shared<tunnel_filter_chain>();
+    chain->add(filter);
+    chain->add(std::make_shared<tunnel_meter>(bytes));
+    return chain;
+}
+
 int tunnel::forward_port(const char* l_ip,uint16_t local_port, const char * target, uint16_t port,
-                         std::function<void(tunnel* tn, int socket, uint32_t channel, std::shared_ptr<tunnel_filter>& send_filter, std::shared_ptr<tunnel_filter>& receive_filter)>
-                         f) {
+                         std::function<void(tunnel* tn, int socket, std::shared_ptr<tunnel_filter>& send_filter, std::shared_ptr<tunnel_filter>& receive_filter)>
+                         f, std::function<bool(uint16_t local_port)> on_idle) {
 
-    return m_mx->add_port_listener(local_port, [this, l_ip, local_port, target, port, f](int newsocket) {
+    int result = m_mx->add_port_listener(local_port, [this, local_port, target, port, f](int newsocket) {
         debugprintf("New connection on %d", local_port);
-        open_remote(target, port, [this, l_ip, target, port, f, newsocket, local_port](mplex * mpx, uint32_t channel) {
-            if(channel <= 0) {
-                //Remote rejected channel
-                close(newsocket);
+        //No filter: data is passed on as it is
+        std::shared_ptr<tunnel_filter> send_filter{};
+        std::shared_ptr<tunnel_filter> receive_filter{};
+        f(this, newsocket, send_filter, receive_filter);
+        send_filter = metered(send_filter, &m_forward_sent);
+        receive_filter = metered(receive_filter, &m_forward_received);
+        std::shared_ptr<forward_connection> fc = std::make_shared<forward_connection>();
+        fc->socket = newsocket;
+        fc->target = target;
+        fc->port = port;
+        fc->receive_filter = receive_filter;
+        fc->local_port = local_port;
+        fc->active = time(nullptr);
+        m_forwards[local_port].active = fc->active;
+        m_connections.push_back(fc);
+        warm_accept(target, port);
+        //Filters write right into the socket buffer or the payload of the next frame
+        fc->to_socket = std::make_shared<tunnel_sink>([this, newsocket](size_t & size) {
+            return (char*) m_mx->write_reserve(newsocket, size);
+        }, [this, newsocket](size_t size, size_t used) {
+            return m_mx->write_commit(newsocket, size, used) >= 0;
+        });
+        fc->to_socket->set_file([this, newsocket](int fd, off_t offset, size_t length, std::shared_ptr<void> keep) {
+            return m_mx->send_file(newsocket, fd, offset, length, keep);
+        });
+        fc->to_socket->set_shared([this, newsocket](std::shared_ptr<const std::string> data) {
+            return m_mx->send_shared(newsocket, data);
+        });
+        fc->to_socket->set_hold([this, newsocket](bool hold) {
+            m_mx->choke(newsocket, hold);
+        });
+        std::weak_ptr<forward_connection> weak_fc = fc;
+        fc->to_socket->set_close([this, weak_fc]() {
+            std::shared_ptr<forward_connection> fc = weak_fc.lock();
+            if(!fc)
+                return;
+            close_forward(fc);
+            m_mx->remove_socket_callback(fc->socket);
+        });
+        std::shared_ptr<tunnel_sink> to_channel = std::make_shared<tunnel_sink>([this, fc](size_t & size) {
+            if(size > sizeof(mplex_frame::payload))
+                size = sizeof(mplex_frame::payload);
+            if(fc->channel != 0)
+                return (char*) m_mplex->reserve_data(fc->channel, size);
+            size_t used = fc->pending.size();
+            fc->pending.resize(used + size);
+            return fc->pending.data() + used;
+        }, [this, fc](size_t size, size_t used) {
+            if(fc->channel != 0)
+                return m_mplex->commit_data(used) >= 0;
+            fc->pending.resize(fc->pending.size() - (size - used));
+            if(!fc->pending.empty() && !fc->opening)
+                open_forward(fc);
+            return true;
+        });
+        //Lets the send filter answer requests itself
+        if(send_filter)
+            send_filter->set_reply(fc->to_socket);
+
+        int result = m_mx->register_socket_callback(newsocket, [this, fc, send_filter, to_channel](int readsocket) {
+            debugprintf("SO: Received something on socket for channel %d", fc->channel);
+            fc->active = time(nullptr);
+            //Read everything we receive from socket right into the next frame for the channel
+            size_t size = sizeof(mplex_frame::payload);
+            bool reserved = (fc->channel != 0);
+            uint8_t * payload;
+            if(reserved) {
+                payload = m_mplex->reserve_data(fc->channel, size);
+            } else {
+                fc->buffer.resize(size);
+                payload = (uint8_t*) fc->buffer.data();
+            }
+            if(payload == nullptr) {
+                close_forward(fc);
                 return false;
             }
-            debugprintf("Connected to %s:%d on channel %d", target, port, channel);
-            std::string local_ip{l_ip};
-            std::shared_ptr<tunnel_filter> send_filter = std::make_shared<tunnel_filter>();
-            std::shared_ptr<tunnel_filter> receive_filter = std::make_shared<tunnel_filter>();
-            f(this, newsocket, channel, send_filter, receive_filter);
-            int result = m_mplex->add_channel_listener(channel, [this, newsocket, target, port, send_filter,
-                  receive_filter](mplex * mpx, mplex_frame * frame) {
-                //Copy everything we get from channel to socket
-                if(frame==nullptr) {
-                    debugprintf("nullptr from channel listener");
-                    m_mx->remove_socket_callback(newsocket);
-                    return false;
+            errno = 0;
+            ssize_t n = read(readsocket, payload, size);
+            debugprintf("n==%ld %s", n, strerror(errno));
+            if(n < 0) {
+                if(reserved)
+                    m_mplex->commit_data(0);
+                close_forward(fc);
+                return false;
+            }
+            if((n == 0) && (errno == EINPROGRESS)) {
+                //Short read, but not EOF. Continue
+                if(reserved)
+                    m_mplex->commit_data(0);
+                return true;
+            }
+            size_t direct = 0;
+            if(n > 0)
+                direct = send_filter ? send_filter->passthrough(n) : n;
+            if(!reserved) {
+                //No channel yet, everything goes to the pending data. A warm one may come along on the way.
+                bool ok = (direct == 0) || to_channel->write((const char*) payload, direct);
+                if(ok && ((n == 0) || (direct < (size_t) n)))
+                    ok = send_filter && send_filter->process((const char*) payload + direct, n - direct, *to_channel);
+                if(fc->channel != 0) {
+                    fc->buffer.clear();
+                    fc->buffer.shrink_to_fit();
                 }
-
-                debugprintf("SO: Received something on channel %d", frame->channel);
-                if(!receive_filter->process((const char*)frame->payload.raw, frame->payload_size, [this, newsocket, send_filter,
-                                                  receive_filter](const char * data,
-                const size_t data_length) {
-                if(data_length == 0)
-                        return true;
-
-                    int n=m_mx->awrite(newsocket, data, data_length);
-                    if( n != data_length ) {
-                        m_mx->remove_socket_callback(newsocket);
-                        return false;
-                    }
-                    return true;
-                })) {
-                    m_mx->remove_socket_callback(newsocket);
+                if(!ok) {
+                    close_forward(fc);
                     return false;
                 }
                 return true;
-            });
-            if(result <0) {
-                return false;
-            } else {
-                m_mplex->add_channel_choke(channel, [this, newsocket](mplex * mpx, uint32_t channel, bool enabled) {
-                    m_mx->choke(newsocket, enabled);
-                });
             }
-
-            result = m_mx->register_socket_callback(newsocket, [this, channel, send_filter, receive_filter](int readsocket) {
-                debugprintf("SO: Received something on socket for channel %d", channel);
-                //Copy everythig we receive from socket to channel
-                mplex_frame frame;
-                errno = 0;
-                frame.payload_size = read(readsocket, frame.payload.raw, sizeof(frame.payload));
-                debugprintf("n==%d %s", frame.payload_size, strerror(errno));
-                if(frame.payload_size < 0) {
-                    m_mplex->remove_channel_listener(channel);
-                    return false;
-                }
-                if((frame.payload_size == 0) && (errno == EINPROGRESS)) {
-                    //Short read, but not EOF. Continue
-                    return true;
-                }
-                if(!send_filter->process((const char*)frame.payload.raw, frame.payload_size, [this, channel,
-                                               send_filter](const char * data,
-                const size_t data_length) {
-                size_t length = data_length;
-                mplex_frame frame;
-                while(length > 0) {
-                        if(length > sizeof(frame.payload)) {
-                            memcpy(frame.payload.raw, data, sizeof(frame.payload));
-                            frame.payload_size = sizeof(frame.payload);
-                            length -= sizeof(frame.payload);
-                            data += sizeof(frame.payload);
-                        } else {
-                            memcpy(frame.payload.raw, data, length);
-                            frame.payload_size = length;
-                            length = 0;
-                        }
-                        if(m_mplex->send_data(channel, &frame) < 0) {
-                            return false;
-                        }
-                    }
-                    return true;
-                })) {
-                    m_mplex->remove_channel_listener(channel);
+            if((n > 0) && (direct == (size_t) n)) {
+                if(m_mplex->commit_data(n) < 0) {
+                    close_forward(fc);
                     return false;
                 }
                 return true;
-            });
-            if(result < 0) {
-                m_mplex->remove_channel_listener(channel);
+            }
+            //The filter output goes into new frames, so the rest can't stay where it is
+            std::string rest((const char*) payload + direct, n - direct);
+            if(m_mplex->commit_data(direct) < 0) {
+                close_forward(fc);
+                return false;
+            }
+            if(!send_filter || !send_filter->process(rest.data(), rest.size(), *to_channel)) {
+                close_forward(fc);
                 return false;
-            } else {
-                m_mx->add_socket_choke(newsocket, [this, channel](int socket, bool enabled) {
-                    m_mplex->send_choke(channel, enabled);
-                });
             }
             return true;
         });
+        if(result < 0) {
+            close(newsocket);
+        }
+    });
+    if(result >= 0)
+        m_forwards[local_port] = forward_listener{time(nullptr), on_idle};
+    return result;
+}
+
+// Channel for a forwarded connection, needed when the first data for the remote is there.
+// A warm channel is used right away, otherwise one is opened.
+void tunnel::open_forward(std::shared_ptr<forward_connection> fc) {
+    std::string key = std::string(fc->target) + ":" + std::to_string(fc->port);
+    uint32_t channel = take_warm(key);
+    if(channel != 0) {
+        debugprintf("Warm channel %d for %s", channel, key.data());
+        attach_forward(fc, channel);
+        warm_up(key);
+        return;
+    }
+    fc->opening = true;
+    open_remote(fc->target, fc->port, [this, fc](mplex * mpx, uint32_t channel) {
+        fc->opening = false;
+        if(channel <= 0) {
+            //Remote rejected channel
+            if(!fc->closed)
+                m_mx->remove_socket_callback(fc->socket);
+            return false;
+        }
+        if(!attach_forward(fc, channel))
+            return false;
+        fc->buffer.clear();
+        fc->buffer.shrink_to_fit();
+        return true;
+    });
+}
+
+// Connect the socket of a forwarded connection with its channel
+bool tunnel::attach_forward(std::shared_ptr<forward_connection> fc, uint32_t channel) {
+    debugprintf("Connected to %s:%d on channel %d", fc->target, fc->port, channel);
+    fc->channel = channel;
+    if(fc->closed) {
+        //Socket is gone already (and its number maybe taken). Send what it left and close.
+        m_mplex->add_channel_listener(channel, [](mplex * mpx, mplex_frame * frame) {
+            return frame != nullptr;
+        });
+        send_pending(fc);
+        m_mplex->remove_channel_listener(channel);
+        return true;
+    }
+    int socket = fc->socket;
+    std::shared_ptr<tunnel_filter> receive_filter = fc->receive_filter;
+    std::shared_ptr<tunnel_sink> to_socket = fc->to_socket;
+    std::weak_ptr<forward_connection> weak_fc = fc;
+    int result = m_mplex->add_channel_listener(channel, [this, socket, receive_filter,
+          to_socket, weak_fc](mplex * mpx, mplex_frame * frame) {
+        //Copy everything we get from channel to socket
+        if(frame==nullptr) {
+            debugprintf("nullptr from channel listener");
+            m_mx->remove_socket_callback(socket);
+            return false;
+        }
+        std::shared_ptr<forward_connection> fc = weak_fc.lock();
+        if(fc)
+            fc->active = time(nullptr);
+
+        debugprintf("SO: Received something on channel %d", frame->channel);
+        size_t direct = 0;
+        if(frame->payload_size > 0)
+            direct = receive_filter ? receive_filter->passthrough(frame->payload_size) : frame->payload_size;
+        if((direct > 0) && (m_mx->awrite(socket, frame->payload.raw, direct) != direct)) {
+            m_mx->remove_socket_callback(socket);
+            return false;
+        }
+        if((frame->payload_size > 0) && (direct == (size_t) frame->payload_size)) {
+            return true;
+        }
+        //Without filter only the end of data gets here
+        if(!receive_filter || !receive_filter->process((const char*)frame->payload.raw + direct,
+                frame->payload_size - direct, *to_socket)) {
+            m_mx->remove_socket_callback(socket);
+            return false;
+        }
+        return true;
+    });
+    if(result <0) {
+        return false;
+    }
+    m_mplex->add_channel_choke(channel, [this, socket](mplex * mpx, uint32_t channel, bool enabled) {
+        m_mx->choke(socket, enabled);
     });
+    send_pending(fc);
+    m_mx->add_socket_choke(socket, [this, channel](int socket, bool enabled) {
+        m_mplex->send_choke(channel, enabled);
+    });
+    return true;
+}
+
+// New local connection to target. The recent ones tell how many channels to keep warm.
+void tunnel::warm_accept(const char * target, uint16_t port) {
+    std::string key = std::string(target) + ":" + std::to_string(port);
+    warm_target & warm = m_warm[key];
+    warm.target = target;
+    warm.port = port;
+    warm.accepts.push_back(time(nullptr));
+    warm_up(key);
+}
+
+// Open channels in the background until there are as many as connections came in lately
+void tunnel::warm_up(const std::string & key) {
+    warm_target & warm = m_warm[key];
+    time_t now = time(nullptr);
+    while(!warm.accepts.empty() && (now - warm.accepts.front() >= TUNNEL_WARM_WINDOW))
+        warm.accepts.pop_front();
+    size_t wanted = std::min(warm.accepts.size(), (size_t) TUNNEL_WARM_MAX);
+    while(warm.ready.size() + warm.opening < wanted) {
+        warm.opening ++;
+        open_remote(warm.target, warm.port, [this, key](mplex * mpx, uint32_t channel) {
+            warm_target & warm = m_warm[key];
+            warm.opening --;
+            if(channel <= 0)
+                return false;
+            //Nothing is expected before the channel is used. Anything else ends it.
+            m_mplex->add_channel_listener(channel, [this, key, channel](mplex * mpx, mplex_frame * frame) {
+                forget_warm(key, channel);
+                return false;
+            });
+            warm.ready.push_back(warm_target::channel{channel, time(nullptr)});
+            return true;
+        });
+    }
+}
+
+// Most recently opened warm channel to target, or 0
+uint32_t tunnel::take_warm(const std::string & key) {
+    auto warm = m_warm.find(key);
+    if((warm == m_warm.end()) || warm->second.ready.empty())
+        return 0;
+    uint32_t channel = warm->second.ready.back().channel;
+    warm->second.ready.pop_back();
+    return channel;
+}
+
+void tunnel::forget_warm(const std::string & key, uint32_t channel) {
+    auto warm = m_warm.find(key);
+    if(warm == m_warm.end())
+        return;
+    auto& ready = warm->second.ready;
+    ready.erase(std::remove_if(ready.begin(), ready.end(), [channel](const warm_target::channel & c) {
+        return c.channel == channel;
+    }), ready.end());
+}
+
+// Called now and then from the event loop: close warm channels nobody took in time or that are too many,
+// connections without traffic and forwards nobody connects to anymore.
+void tunnel::expire() {
+    time_t now = time(nullptr);
+    if(now == m_checked)
+        return;
+    m_checked = now;
+    for(auto target = m_warm.begin(); target != m_warm.end();) {
+        warm_target & warm = target->second;
+        while(!warm.accepts.empty() && (now - warm.accepts.front() >= TUNNEL_WARM_WINDOW))
+            warm.accepts.pop_front();
+        size_t wanted = std::min(warm.accepts.size(), (size_t) TUNNEL_WARM_MAX);
+        while(!warm.ready.empty() && ((warm.ready.size() > wanted)
+                                      || (now - warm.ready.front().since >= TUNNEL_WARM_TIMEOUT))) {
+            uint32_t channel = warm.ready.front().channel;
+            warm.ready.pop_front();
+            m_mplex->remove_channel_listener(channel);
+        }
+        if(warm.accepts.empty() && warm.ready.empty() && (warm.opening == 0))
+            target = m_warm.erase(target);
+        else
+            target ++;
+    }
+    std::map<uint16_t, size_t> busy{};
+    size_t connections = reap_connections(now, busy);
+    size_t ports = reap_forwards(now, busy);
+    if((connections > 0) || (ports > 0))
+        report();
+}
+
+// Close forwarded connections that moved no data for a while. Counts the remaining ones per local port.
+size_t tunnel::reap_connections(time_t now, std::map<uint16_t, size_t> & busy) {
+    size_t reaped = 0;
+    for(auto connection = m_connections.begin(); connection != m_connections.end();) {
+        std::shared_ptr<forward_connection> fc = connection->lock();
+        if(!fc || fc->closed) {
+            connection = m_connections.erase(connection);
+            continue;
+        }
+        if((m_channel_idle > 0) && (now - fc->active >= m_channel_idle)) {
+            debugprintf("Connection on %d idle for %lds, close it", fc->local_port, now - fc->active);
+            close_forward(fc);
+            m_mx->remove_socket_callback(fc->socket);
+            connection = m_connections.erase(connection);
+            reaped ++;
+            continue;
+        }
+        busy[fc->local_port] ++;
+        connection ++;
+    }
+    m_reaped_connections += reaped;
+    return reaped;
+}
+
+// Remove forwards that accepted nothing for a while and have no connections left, if their owner agrees
+size_t tunnel::reap_forwards(time_t now, const std::map<uint16_t, size_t> & busy) {
+    if(m_port_idle <= 0)
+        return 0;
+    std::vector<uint16_t> idle{};
+    for(auto& forward: m_forwards) {
+        if(forward.second.on_idle && (now - forward.second.active >= m_port_idle)
+                && (busy.find(forward.first) == busy.end()))
+            idle.push_back(forward.first);
+    }
+    size_t reaped = 0;
+    for(auto local_port: idle) {
+        //on_idle may revoke more forwards, this one included
+        auto forward = m_forwards.find(local_port);
+        if(forward == m_forwards.end())
+            continue;
+        std::function<bool(uint16_t local_port)> on_idle = forward->second.on_idle;
+        //Ask again after one more period
+        forward->second.active = now;
+        if(!on_idle(local_port))
+            continue;
+        debugprintf("Forward on %d idle, remove it", local_port);
+        if(m_forwards.find(local_port) != m_forwards.end())
+            rewoke_forward(local_port);
+        reaped ++;
+    }
+    m_reaped_ports += reaped;
+    return reaped;
+}
+
+// Close forwarded connections idle for channel_idle seconds and forwards idle for port_idle seconds, 0 never
+void tunnel::set_idle(time_t channel_idle, time_t port_idle) {
+    m_channel_idle = channel_idle;
+    m_port_idle = port_idle;
+}
+
+void tunnel::report() {
+    fprintf(stderr, "FORWARD %ld ports, %ld connections, %ld channels, %ld local ports free, reaped %ld connections "
+            "and %ld ports, %ld KB sent, %ld KB received\n", m_forwards.size(), m_connections.size(),
+            m_mplex->channel_count(), free_local_ports(), m_reaped_connections, m_reaped_ports, m_forward_sent >> 10,
+            m_forward_received >> 10);
+}
+
+// What the socket had for the remote before its channel was open
+void tunnel::send_pending(std::shared_ptr<forward_connection> fc) {
+    for(size_t pos = 0; pos < fc->pending.size(); pos += sizeof(mplex_frame::payload)) {
+        size_t size = std::min(fc->pending.size() - pos, sizeof(mplex_frame::payload));
+        m_mplex->send_data(fc->channel, fc->pending.data() + pos, size);
+    }
+    fc->pending.clear();
+    fc->pending.shrink_to_fit();
+}
+
+// Socket side is done. Without a channel there is nothing to tell the remote, unless one is on its way.
+void tunnel::close_forward(std::shared_ptr<forward_connection> fc) {
+    if(fc->channel != 0)
+        m_mplex->reset_channel(fc->channel);
+    else if(fc->opening)
+        fc->closed = true;
 }
 
 void tunnel::rewoke_forward(uint16_t local_port) {
+    m_forwards.erase(local_port);
     m_mx->remove_port_listener(local_port);
     free_local_port(local_port);
 }
 
+//0 means unlimited
+void tunnel::set_max_channels(size_t max_channels) {
+    m_max_channels = max_channels;
+}
+
+//Bytes kept per channel while the client chokes it, 0 disables read-ahead
+void tunnel::set_read_ahead(size_t max_read_ahead) {
+    m_max_read_ahead = max_read_ahead;
+}
+
+//Upstream data of the channel waiting for the client to take data again
+size_t tunnel::read_ahead_occupancy(uint32_t channel) {
+    auto ra = m_read_ahead.find(channel);
+    if(ra == m_read_ahead.end())
+        return 0;
+    return ra->second->buffer.size();
+}
+
+//About one round trip worth of data: what the tunnel connection has in flight
+size_t tunnel::read_ahead_limit() {
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+    //Not TCP, e.g. stdio: no measure, use the maximum
+    if(getsockopt(m_socket, IPPROTO_TCP, TCP_INFO, &info, &length) != 0)
+        return m_max_read_ahead;
+    size_t bdp = (size_t) info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+    return std::min(std::max(bdp, (size_t) TUNNEL_READ_AHEAD_MIN), m_max_read_ahead);
+}
+
+// While the client chokes the channel, upstream is still read up to the limit. So the data is
+// here already when the client takes data again, instead of one more round trip to upstream.
+bool tunnel::fill_read_ahead(int socket, std::shared_ptr<read_ahead> ra, std::shared_ptr<upstream_connection> up) {
+    size_t used = ra->buffer.size();
+    if(used >= ra->limit) {
+        m_mx->choke(socket, true);
+        return true;
+    }
+    ra->buffer.resize(ra->limit);
+    errno = 0;
+    ssize_t n = read(socket, ra->buffer.data() + used, ra->limit - used);
+    ra->buffer.resize(used + ((n > 0) ? n : 0));
+    if(up && (n > 0))
+        up->response(ra->buffer.data() + used, n);
+    if((n < 0) || ((n == 0) && (errno != EINPROGRESS))) {
+        //End of upstream is handled once the buffer is out
+        if(up)
+            up->fail();
+        m_mx->choke(socket, true);
+        return true;
+    }
+    if(ra->buffer.size() >= ra->limit)
+        m_mx->choke(socket, true);
+    return true;
+}
+
+void tunnel::choke_read_ahead(uint32_t channel, int socket, std::shared_ptr<read_ahead> ra,
+                              std::shared_ptr<channel_shaper> shaper, bool enabled) {
+    ra->choked = enabled;
+    if(enabled) {
+        ra->limit = read_ahead_limit();
+        debugprintf("Channel %d choked, read ahead up to %ld bytes", channel, ra->limit);
+        if(ra->buffer.size() >= ra->limit)
+            m_mx->choke(socket, true);
+        return;
+    }
+    if(!ra->buffer.empty()) {
+        debugprintf("Channel %d unchoked, send %ld bytes read ahead", channel, ra->buffer.size());
+        m_mplex->send_data_response(channel, ra->buffer.data(), ra->buffer.size());
+        shape(socket, shaper, ra->buffer.size());
+        ra->buffer.clear();
+    }
+    m_mx->choke(socket, false);
+}
+
+// Limit the tunnel and each bulk channel to so many bytes per second, 0 means unlimited.
+// Keeping the link just below its capacity keeps the queues short for everything else.
+void tunnel::set_rate(size_t tunnel_rate, size_t channel_rate) {
+    m_bucket = token_bucket(tunnel_rate, std::max(tunnel_rate / 20, (size_t) TUNNEL_BURST_MIN));
+    m_channel_rate = channel_rate;
+}
+
+// Bulk channels read no more than a bucket holds, so one read does not flood the link
+size_t tunnel::shaped_read_size(std::shared_ptr<channel_shaper> shaper) {
+    size_t size = sizeof(mplex_frame::payload);
+    if(!shaper || (shaper->sent < TUNNEL_BULK_BYTES))
+        return size;
+    if(m_bucket.rate() > 0)
+        size = std::min(size, m_bucket.burst());
+    if(shaper->bucket.rate() > 0)
+        size = std::min(size, shaper->bucket.burst());
+    return size;
+}
+
+// Account data sent for a channel. Bulk channels stop reading until the buckets allow more.
+void tunnel::shape(int socket, std::shared_ptr<channel_shaper> shaper, size_t size) {
+    if(!shaper)
+        return;
+    //The link is used either way. The channel's own rate only counts from the bulk part on.
+    uint64_t wait = m_bucket.take(size);
+    shaper->sent += size;
+    if(shaper->sent < TUNNEL_BULK_BYTES)
+        return;
+    wait = std::max(wait, shaper->bucket.take(size));
+    if(wait > 0)
+        m_mx->pause(socket, wait);
+}
+
+//Keep connections to media servers for the next channel
+void tunnel::use_upstream_pool(upstream_pool * pool) {
+    m_upstream_pool = pool;
+}
+
+//Serve SSDP channels from a listener shared with other tunnels
+void tunnel::use_ssdp_hub(ssdp_hub * hub) {
+    m_ssdp_hub = hub;
+}
+
 bool tunnel::receive(int socket) {
     if(m_mplex != nullptr)
         return m_mplex->receive(socket);
@@ -343,11 +879,29 @@ bool tunnel::receive(int socket) {
         errorprintf("Loosing mplex message!");
     return false;
 }
-static uint16_t pp{50000};
+//Local ports are shared by all tunnels of all threads
+static std::mutex s_ports_lock{};
+static uint16_t s_next_port{50000};
+static std::deque<std::pair<uint16_t, time_t>> s_free_ports{};
+
+// A port freed long enough ago, else a new one
 uint16_t tunnel::get_local_port() {
-    return pp++;
+    std::lock_guard<std::mutex> lock(s_ports_lock);
+    if(!s_free_ports.empty() && (time(nullptr) - s_free_ports.front().second >= TUNNEL_PORT_QUARANTINE)) {
+        uint16_t port = s_free_ports.front().first;
+        s_free_ports.pop_front();
+        return port;
+    }
+    return s_next_port++;
 }
 
 void tunnel::free_local_port(uint16_t port) {
+    std::lock_guard<std::mutex> lock(s_ports_lock);
+    s_free_ports.push_back({port, time(nullptr)});
+}
+
+size_t tunnel::free_local_ports() {
+    std::lock_guard<std::mutex> lock(s_ports_lock);
+    return s_free_ports.size();
 }
 
@@ -18,11 +18,68 @@
 
 #ifndef __TUNNEL_H
 #define __TUNNEL_H
+#include <time.h>
+#include <deque>
 #include <functional>
+#include <list>
+#include <map>
 #include <memory>
+#include <string>
 #include "mplex.h"
 #include "socketmultiplex.h"
 #include "tunnel_filter.h"
+#include "ssdp_hub.h"
+#include "upstream_pool.h"
+#include "token_bucket.h"
+
+//Local end of a forwarded connection. Its channel is only opened once there is data for the remote.
+struct forward_connection {
+    int socket{0};
+    uint16_t local_port{0};
+    time_t active{0}; //last data in either direction
+    const char * target{nullptr};
+    uint16_t port{0};
+    uint32_t channel{0};
+    bool opening{false};
+    bool closed{false}; //socket went away while the channel was being opened
+    std::string pending{}; //filtered data waiting for the channel
+    std::string buffer{}; //reads go here while there is no channel
+    std::shared_ptr<tunnel_filter> receive_filter{};
+    std::shared_ptr<tunnel_sink> to_socket{};
+};
+
+//Client: local port forwarded to a target. on_idle decides whether it may go once nobody used it for a while.
+struct forward_listener {
+    time_t active{0}; //last accept
+    std::function<bool(uint16_t local_port)> on_idle{};
+};
+
+//Client: channels opened ahead of time for the next connections to a target, as many as recently accepted
+struct warm_target {
+    struct channel {
+        uint32_t channel{0};
+        time_t since{0};
+    };
+    const char * target{nullptr};
+    uint16_t port{0};
+    std::deque<channel> ready{};
+    size_t opening{0};
+    std::deque<time_t> accepts{};
+};
+
+//Server end of a forwarded connection: upstream data read while the peer chokes the channel
+struct read_ahead {
+    std::string buffer{};
+    size_t limit{0};
+    bool choked{false};
+};
+
+//Server end of a forwarded connection: what it sent, and its own rate once it carries bulk data
+struct channel_shaper {
+    channel_shaper(size_t rate, size_t burst) : bucket{rate, burst} {};
+    token_bucket bucket;
+    size_t sent{0};
+};
 
 class tunnel {
 public:
@@ -33,21 +90,68 @@ public:
     int open_remote(const char * target, uint16_t port, std::function<bool(mplex * mpx, uint32_t channel)> f);
     int open_udp_mcast(const char * target, uint16_t port, std::function<bool(mplex * mpx, uint32_t channel)> f);
     int forward_port(const char * local_ip, uint16_t local_port, const char * target, uint16_t port,
-                     std::function<void(tunnel* tn, int socket, uint32_t channel, std::shared_ptr<tunnel_filter>& send_filter, std::shared_ptr<tunnel_filter>& receive_filter)>
-                     f);
+                     std::function<void(tunnel* tn, int socket, std::shared_ptr<tunnel_filter>& send_filter, std::shared_ptr<tunnel_filter>& receive_filter)>
+                     f, std::function<bool(uint16_t local_port)> on_idle=nullptr);
     void rewoke_forward(uint16_t local_port);
 
     bool receive(int socket);
+    void expire();
+    void set_max_channels(size_t max_channels);
+    void set_read_ahead(size_t max_read_ahead);
+    void set_rate(size_t tunnel_rate, size_t channel_rate);
+    void set_idle(time_t channel_idle, time_t port_idle);
+    void report();
+    size_t read_ahead_occupancy(uint32_t channel);
+    void use_ssdp_hub(ssdp_hub * hub);
+    void use_upstream_pool(upstream_pool * pool);
     static uint16_t get_local_port();
     static void free_local_port(uint16_t port);
+    static size_t free_local_ports();
 private:
     socketmultiplex * m_mx;
     mplex *m_mplex;
     int m_socket;
+    size_t m_max_channels{0};
+    size_t m_max_read_ahead{0};
+    std::map<uint32_t, std::shared_ptr<read_ahead>> m_read_ahead{};
+    std::map<std::string, warm_target> m_warm{};
+    token_bucket m_bucket{0, 0};
+    size_t m_channel_rate{0};
+    std::map<uint16_t, forward_listener> m_forwards{};
+    std::list<std::weak_ptr<forward_connection>> m_connections{};
+    time_t m_channel_idle{0};
+    time_t m_port_idle{0};
+    size_t m_reaped_connections{0};
+    size_t m_reaped_ports{0};
+    size_t m_forward_sent{0}; //bytes of forwarded connections to the remote, counted by their meters
+    size_t m_forward_received{0};
+    time_t m_checked{0};
+    ssdp_hub * m_ssdp_hub{nullptr};
+    upstream_pool * m_upstream_pool{nullptr};
     std::function<void(tunnel*tn)> m_on_ready;
 
     void on_mplex_ready(mplex* mpx);
     bool on_mplex_connect(mplex * mpx, uint32_t channel, void* reason, uint8_t size);
+    bool connect_ssdp_hub(uint32_t channel);
+    bool connect_endpoint(uint32_t channel, int port_socket, std::shared_ptr<read_ahead> ra,
+                          std::shared_ptr<upstream_connection> up, std::shared_ptr<channel_shaper> shaper);
+    void release_endpoint(uint32_t channel, int port_socket, std::shared_ptr<upstream_connection> up);
+    size_t read_ahead_limit();
+    bool fill_read_ahead(int socket, std::shared_ptr<read_ahead> ra, std::shared_ptr<upstream_connection> up);
+    void choke_read_ahead(uint32_t channel, int socket, std::shared_ptr<read_ahead> ra,
+                          std::shared_ptr<channel_shaper> shaper, bool enabled);
+    size_t shaped_read_size(std::shared_ptr<channel_shaper> shaper);
+    void shape(int socket, std::shared_ptr<channel_shaper> shaper, size_t size);
+    void open_forward(std::shared_ptr<forward_connection> fc);
+    bool attach_forward(std::shared_ptr<forward_connection> fc, uint32_t channel);
+    void warm_accept(const char * target, uint16_t port);
+    void warm_up(const std::string & key);
+    uint32_t take_warm(const std::string & key);
+    void forget_warm(const std::string & key, uint32_t channel);
+    void send_pending(std::shared_ptr<forward_connection> fc);
+    void close_forward(std::shared_ptr<forward_connection> fc);
+    size_t reap_connections(time_t now, std::map<uint16_t, size_t> & busy);
+    size_t reap_forwards(time_t now, const std::map<uint16_t, size_t> & busy);
 };
 
 #endif
@@ -18,10 +18,101 @@
 
 #include <functional>
 #include <string>
+#include <string.h>
+#include <unistd.h>
 #include "tunnel_filter.h"
 
-bool tunnel_filter::process(const char * data, const size_t data_length,
-                            std::function<bool(const char * data, const size_t data_length)> f) {
+tunnel_sink::tunnel_sink(std::function<char*(size_t & size)> get, std::function<bool(size_t size, size_t used)> put):
+    m_get{get},
+    m_put{put} {
+}
+
+char * tunnel_sink::get(size_t & size) {
+    char * buffer = m_get(size);
+    m_size = (buffer == nullptr) ? 0 : size;
+    return buffer;
+}
+
+bool tunnel_sink::put(size_t used) {
+    size_t size = m_size;
+    m_size = 0;
+    return m_put(size, used);
+}
+
+bool tunnel_sink::write(const char * data, const size_t data_length) {
+    size_t left = data_length;
+    while(left > 0) {
+        size_t size = left;
+        char * buffer = get(size);
+        if((buffer == nullptr) || (size == 0))
+            return false;
+        memcpy(buffer, data, size);
+        if(!put(size))
+            return false;
+        data += size;
+        left -= size;
+    }
+    return true;
+}
+
+bool tunnel_sink::operator()(const char * data, const size_t data_length) {
+    return write(data, data_length);
+}
+
+void tunnel_sink::set_file(file_function file) {
+    m_file = file;
+}
+
+bool tunnel_sink::send_file(int fd, off_t offset, size_t length, std::shared_ptr<void> keep) {
+    if(m_file)
+        return m_file(fd, offset, length, keep);
+    while(length > 0) {
+        size_t size = length;
+        char * buffer = get(size);
+        if((buffer == nullptr) || (size == 0))
+            return false;
+        ssize_t n = pread(fd, buffer, size, offset);
+        if(n <= 0) {
+            put(0);
+            return false;
+        }
+        if(!put(n))
+            return false;
+        offset += n;
+        length -= n;
+    }
+    return true;
+}
+
+void tunnel_sink::set_shared(shared_function shared) {
+    m_shared = shared;
+}
+
+bool tunnel_sink::send_shared(std::shared_ptr<const std::string> data) {
+    if(m_shared)
+        return m_shared(data);
+    return write(data->data(), data->size());
+}
+
+void tunnel_sink::set_hold(std::function<void(bool hold)> hold) {
+    m_hold = hold;
+}
+
+void tunnel_sink::hold(bool hold) {
+    if(m_hold)
+        m_hold(hold);
+}
+
+void tunnel_sink::set_close(std::function<void()> close) {
+    m_close = close;
+}
+
+void tunnel_sink::close() {
+    if(m_close)
+        m_close();
+}
+
+bool tunnel_filter::process(const char * data, const size_t data_length, tunnel_sink & f) {
     if(data_length == 0) {
         f(data, data_length);
         return false;
@@ -30,3 +121,67 @@ bool tunnel_filter::process(const char * data, const size_t data_length,
     }
 }
 
+
+size_t tunnel_filter::passthrough(const size_t data_length) {
+    return data_length;
+}
+
+void tunnel_filter::set_reply(std::shared_ptr<tunnel_sink> reply) {
+}
+
+void tunnel_filter_chain::add(std::shared_ptr<tunnel_filter> stage) {
+    m_stages.push_back(stage);
+    m_buffers.emplace_back();
+    m_skip.push_back(0);
+}
+
+size_t tunnel_filter_chain::size() const {
+    return m_stages.size();
+}
+
+bool tunnel_filter_chain::process_stage(size_t stage, const char * data, const size_t data_length,
+                                        tunnel_sink & f) {
+    if(stage == m_stages.size())
+        return (data_length == 0) || f(data, data_length);
+    auto next = [this, stage, &f](const char * data, const size_t data_length) {
+        return process_stage(stage + 1, data, data_length, f);
+    };
+    if(data_length == 0) {
+        //End of data. Flush this stage into the next, then end the next.
+        m_buffers[stage].process(*m_stages[stage], nullptr, 0, next);
+        process_stage(stage + 1, nullptr, 0, f);
+        return false;
+    }
+    //Bytes this stage let pass already
+    size_t skip = (m_skip[stage] < data_length) ? m_skip[stage] : data_length;
+    m_skip[stage] -= skip;
+    if((skip > 0) && !next(data, skip))
+        return false;
+    if(skip == data_length)
+        return true;
+    return m_buffers[stage].process(*m_stages[stage], data + skip, data_length - skip, next);
+}
+
+bool tunnel_filter_chain::process(const char * data, const size_t data_length, tunnel_sink & f) {
+    if(m_stages.empty())
+        return tunnel_filter::process(data, data_length, f);
+    return process_stage(0, data, data_length, f);
+}
+
+size_t tunnel_filter_chain::passthrough(const size_t data_length) {
+    std::vector<size_t> passed(m_stages.size());
+    size_t length = data_length;
+    for(size_t stage = 0; stage < m_stages.size(); stage++) {
+        length = m_stages[stage]->passthrough(length);
+        passed[stage] = length;
+    }
+    for(size_t stage = 0; stage < m_stages.size(); stage++) {
+        m_skip[stage] += passed[stage] - length;
+    }
+    return length;
+}
+
+void tunnel_filter_chain::set_reply(std::shared_ptr<tunnel_sink> reply) {
+    for(auto& stage: m_stages)
+        stage->set_reply(reply);
+}
@@ -20,12 +20,176 @@
 #define __TUNNEL_FILTER_H
 
 #include <functional>
+#include <memory>
+#include <sys/types.h>
 #include <string>
+#include <vector>
 
+/* Where a filter puts its output. get() hands out up to size bytes of space right in the buffer
+ * of the receiver, e.g. the payload of the next mplex frame, put() sends what was filled in.
+ * write() copies data into it. send_file() passes part of a file, send_shared() a buffer other
+ * sinks get as well, both without copy if the receiver knows how. */
+class tunnel_sink {
+public:
+    typedef std::function<bool(int fd, off_t offset, size_t length, std::shared_ptr<void> keep)> file_function;
+    typedef std::function<bool(std::shared_ptr<const std::string> data)> shared_function;
+
+    tunnel_sink(std::function<char*(size_t & size)> get, std::function<bool(size_t size, size_t used)> put);
+
+    char * get(size_t & size);
+    bool put(size_t used);
+    bool write(const char * data, const size_t data_length);
+    bool operator()(const char * data, const size_t data_length);
+    void set_file(file_function file);
+    bool send_file(int fd, off_t offset, size_t length, std::shared_ptr<void> keep);
+    void set_shared(shared_function shared);
+    bool send_shared(std::shared_ptr<const std::string> data);
+    //Whoever reads the other end: stop taking data from it for a while, or give it up
+    void set_hold(std::function<void(bool hold)> hold);
+    void hold(bool hold);
+    void set_close(std::function<void()> close);
+    void close();
+private:
+    std::function<char*(size_t & size)> m_get;
+    std::function<bool(size_t size, size_t used)> m_put;
+    file_function m_file{};
+    shared_function m_shared{};
+    std::function<void(bool hold)> m_hold{};
+    std::function<void()> m_close{};
+    size_t m_size{0}; //handed out by the last get()
+};
+
+/* Passes everything on unchanged. Processing data_length 0 means end of data: filters flush
+ * what they hold back and return false. */
 class tunnel_filter {
 public:
-    virtual bool process(const char * data, const size_t data_length,
-                         std::function<bool(const char * data, const size_t data_length)> f);
+    virtual ~tunnel_filter() = default;
+    virtual bool process(const char * data, const size_t data_length, tunnel_sink & f);
+    //How many of the next data_length bytes need no filtering. These are counted as processed,
+    //the caller sends them on as they are.
+    virtual size_t passthrough(const size_t data_length);
+    //Where answers go that the filter gives itself, without the remote
+    virtual void set_reply(std::shared_ptr<tunnel_sink> reply);
+};
+
+/* Output of one stage, collected to be handed to the next one. */
+class tunnel_stage_buffer {
+public:
+    template<typename Next>
+    bool process(tunnel_filter & stage, const char * data, const size_t data_length, Next next) {
+        tunnel_sink link([this](size_t & size) {
+            m_buffer.resize(size);
+            return m_buffer.data();
+        }, [&next, this](size_t size, size_t used) {
+            return (used == 0) || next(m_buffer.data(), used);
+        });
+        return stage.process(data, data_length, link);
+    }
+private:
+    std::string m_buffer{};
+};
+
+/* Several filters after each other, e.g. rewrite, compress, meter. Bytes a stage lets pass
+ * through are remembered (m_skip), so later stages still see them in order. */
+class tunnel_filter_chain : public tunnel_filter {
+public:
+    void add(std::shared_ptr<tunnel_filter> stage);
+    size_t size() const;
+
+    bool process(const char * data, const size_t data_length, tunnel_sink & f) override;
+    size_t passthrough(const size_t data_length) override;
+    void set_reply(std::shared_ptr<tunnel_sink> reply) override;
+private:
+    bool process_stage(size_t stage, const char * data, const size_t data_length, tunnel_sink & f);
+    std::vector<std::shared_ptr<tunnel_filter>> m_stages{};
+    std::vector<tunnel_stage_buffer> m_buffers{};
+    std::vector<size_t> m_skip{};
+};
+
+/* Same as tunnel_filter_chain for stages known at compile time. Stages are members and called
+ * without virtual dispatch, a single stage writes to the output directly and the empty stack
+ * is the identity. */
+template<typename... Stages>
+class tunnel_filter_stack;
+
+template<>
+class tunnel_filter_stack<> final : public tunnel_filter {
+public:
+    bool process(const char * data, const size_t data_length, tunnel_sink & f) override {
+        return tunnel_filter::process(data, data_length, f);
+    }
+    size_t passthrough(const size_t data_length) override {
+        return data_length;
+    }
+};
+
+template<typename First, typename... Rest>
+class tunnel_filter_stack<First, Rest...> final : public tunnel_filter {
+public:
+    tunnel_filter_stack(First first, Rest... rest):
+        m_first{std::move(first)},
+        m_rest{std::move(rest)...} {
+    }
+
+    bool process(const char * data, const size_t data_length, tunnel_sink & f) override {
+        if constexpr(sizeof...(Rest) == 0) {
+            return m_first.First::process(data, data_length, f);
+        } else {
+            auto next = [this, &f](const char * data, const size_t data_length) {
+                return m_rest.process(data, data_length, f);
+            };
+            if(data_length == 0) {
+                m_buffer.process(m_first, nullptr, 0, next);
+                return m_rest.process(nullptr, 0, f);
+            }
+            size_t skip = (m_skip < data_length) ? m_skip : data_length;
+            m_skip -= skip;
+            if((skip > 0) && !next(data, skip))
+                return false;
+            if(skip == data_length)
+                return true;
+            return m_buffer.process(m_first, data + skip, data_length - skip, next);
+        }
+    }
+
+    size_t passthrough(const size_t data_length) override {
+        size_t first = m_first.First::passthrough(data_length);
+        if constexpr(sizeof...(Rest) == 0) {
+            return first;
+        } else {
+            size_t rest = m_rest.passthrough(first);
+            m_skip += first - rest;
+            return rest;
+        }
+    }
+
+    void set_reply(std::shared_ptr<tunnel_sink> reply) override {
+        m_first.First::set_reply(reply);
+        m_rest.set_reply(reply);
+    }
+private:
+    First m_first;
+    tunnel_filter_stack<Rest...> m_rest;
+    tunnel_stage_buffer m_buffer{};
+    size_t m_skip{0};
+};
+
+/* Counts the bytes that pass and changes nothing. Goes last, after e.g. a rewrite, so it counts
+ * what really leaves. Final, so a tunnel_filter_stack calls it inline. */
+class tunnel_meter final : public tunnel_filter {
+public:
+    tunnel_meter(size_t * bytes) : m_bytes{bytes} {}
+
+    bool process(const char * data, const size_t data_length, tunnel_sink & f) override {
+        *m_bytes += data_length;
+        return tunnel_filter::process(data, data_length, f);
+    }
+    size_t passthrough(const size_t data_length) override {
+        *m_bytes += data_length;
+        return data_length;
+    }
+private:
+    size_t * m_bytes;
 };
 
 #endif
@@ -0,0 +1,142 @@
+/*
+ * dlnatunnel
+ * Copyright (C) 2023 Stefan Wildemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <thread>
+
+#include "tunnel_worker.h"
+#include "tunnel.h"
+#include "tls.h"
+//#define DEBUG
+#include "debugprintf.h"
+
+tunnel_worker::tunnel_worker(tls_context * tls, tunnel_limits limits, ssdp_hub * hub):
+    m_tls{tls},
+    m_limits{limits},
+    m_ssdp_hub{hub},
+    m_pool{&m_px, limits.upstream_idle} {
+}
+
+tunnel_worker::~tunnel_worker() {
+    stop();
+    for(auto& tn: m_tunnels) {
+        delete tn.second;
+    }
+    m_tunnels.clear();
+}
+
+bool tunnel_worker::start() {
+    m_running = true;
+    m_thread = std::thread([this]() {
+        run();
+    });
+    return true;
+}
+
+void tunnel_worker::stop() {
+    if(!m_running)
+        return;
+    m_running = false;
+    //wake up select
+    m_px.post([]() {});
+    if(m_thread.joinable())
+        m_thread.join();
+}
+
+void tunnel_worker::run() {
+    while(m_running) {
+        struct timeval tv;
+        tv.tv_sec=1;
+        tv.tv_usec=0;
+        m_px.handle_sockets(tv);
+        m_pool.expire();
+        for(auto& tn: m_tunnels)
+            tn.second->expire();
+    }
+}
+
+// Called from listener thread
+void tunnel_worker::add_connection(int socket) {
+    m_count ++;
+    m_px.post([this, socket]() {
+        start_tunnel(socket);
+    });
+}
+
+// Run f inside the workers thread
+void tunnel_worker::post(std::function<void(socketmultiplex * mx)> f) {
+    m_px.post([this, f]() {
+        f(&m_px);
+    });
+}
+
+size_t tunnel_worker::tunnel_count() {
+    return m_count;
+}
+
+void tunnel_worker::start_tunnel(int port_socket) {
+    //The handshake does not block the worker, other tunnels keep running meanwhile. Until it is done the
+    //connection still counts, so the listener keeps balancing and --max-tunnels covers handshakes as well.
+    auto open = [this](int port_socket, bool ok) {
+        m_count --;
+        if(!ok)
+            return;
+        add_tunnel(port_socket, -1, [](tunnel * tn) {
+            fprintf(stderr, "TUNNEL ready\n");
+            return;
+        }, nullptr);
+    };
+    if(m_tls == nullptr)
+        open(port_socket, true);
+    else if(!m_tls->secure(&m_px, port_socket, open)) {
+        m_count --;
+        close(port_socket);
+    }
+}
+
+// Must be called inside the workers thread
+tunnel * tunnel_worker::add_tunnel(int socket, int write_socket, std::function<void(tunnel* tn)> on_ready,
+                                   std::function<void(tunnel* tn)> on_close) {
+    tunnel * tn = new tunnel(&m_px, socket, on_ready);
+    tn->set_max_channels(m_limits.max_channels);
+    tn->set_read_ahead(m_limits.read_ahead);
+    tn->set_rate(m_limits.rate, m_limits.channel_rate);
+    tn->set_idle(m_limits.channel_idle, m_limits.port_idle);
+    tn->use_ssdp_hub(m_ssdp_hub);
+    tn->use_upstream_pool(&m_pool);
+    m_tunnels[socket] = tn;
+    m_count ++;
+    m_px.register_socket_callback(socket, [this, tn, on_close] (int socket) {
+        if(!tn->receive(socket)) {
+            fprintf(stderr, "TUNNEL closed\n");
+            tn->report();
+            m_pool.report();
+            m_tunnels.erase(socket);
+            if(on_close)
+                on_close(tn);
+            delete tn;
+            m_count --;
+            return false;
+        }
+        return true;
+    }, write_socket);
+    tn->run();
+    return tn;
+}
@@ -0,0 +1,69 @@
+/*
+ * dlnatunnel
+ * Copyright (C) 2023 Stefan Wildemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TUNNEL_WORKER_H
+#define __TUNNEL_WORKER_H
+#include <atomic>
+#include <map>
+#include <thread>
+#include "socketmultiplex.h"
+#include "tunnel.h"
+#include "tls.h"
+#include "ssdp_hub.h"
+#include "upstream_pool.h"
+
+struct tunnel_limits {
+    size_t max_channels{0}; //per tunnel, 0 means unlimited
+    size_t read_ahead{0}; //per channel, bytes read while the client chokes, 0 disables
+    size_t upstream_idle{4}; //per media server, idle connections kept for reuse, 0 disables
+    size_t rate{0}; //per tunnel, bytes per second, 0 means unlimited
+    size_t channel_rate{0}; //per bulk channel, bytes per second, 0 means unlimited
+    time_t channel_idle{600}; //client: seconds a forwarded connection may move no data, 0 means forever
+    time_t port_idle{3600}; //client: seconds a forwarded port may accept nothing, 0 means forever
+};
+
+/* Event loop thread serving any number of tunnels. Each tunnel has its own mplex state.
+ * On the server the listener hands new connections over using add_connection(). On the
+ * client every upstream site gets a worker of its own, so a slow site does not stall the others. */
+class tunnel_worker {
+public:
+    tunnel_worker(tls_context * tls, tunnel_limits limits, ssdp_hub * hub=nullptr);
+    ~tunnel_worker();
+
+    bool start();
+    void stop();
+    void add_connection(int socket);
+    void post(std::function<void(socketmultiplex * mx)> f);
+    tunnel * add_tunnel(int socket, int write_socket, std::function<void(tunnel* tn)> on_ready,
+                        std::function<void(tunnel* tn)> on_close);
+    size_t tunnel_count();
+private:
+    void run();
+    void start_tunnel(int socket);
+    socketmultiplex m_px{};
+    tls_context * m_tls;
+    tunnel_limits m_limits;
+    ssdp_hub * m_ssdp_hub;
+    upstream_pool m_pool;
+    std::thread m_thread{};
+    std::atomic<bool> m_running{false};
+    std::atomic<size_t> m_count{0};
+    std::map<int, tunnel*> m_tunnels{};
+};
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ * dlnatunnel
+ * Copyright (C) 2023 Stefan Wildemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <string>
+#include <string_view>
+
+#include "upstream_pool.h"
+#include "stringtoken.h"
+//#define DEBUG
+#include "debugprintf.h"
+
+upstream_connection::upstream_connection(const std::string & host, uint16_t port):
+    m_host{host},
+    m_port{port},
+    m_pending{std::make_shared<http_requests>()},
+    m_requests{host + std::string(":") + std::to_string(port)},
+    m_responses{host + std::string(":") + std::to_string(port)} {
+    m_requests.track_requests(m_pending);
+    m_responses.track_requests(m_pending);
+}
+
+void upstream_connection::request(const char * data, size_t size) {
+    track(m_requests, data, size);
+}
+
+void upstream_connection::response(const char * data, size_t size) {
+    track(m_responses, data, size);
+}
+
+// Data is sent on as it is, the parsers only follow it. Bodies are skipped without parsing.
+void upstream_connection::track(http & direction, const char * data, size_t size) {
+    if(m_failed || (size == 0))
+        return;
+    size_t direct = direction.passthrough(size);
+    if(direct == size)
+        return;
+    tunnel_sink output([this](size_t & size) {
+        m_output.resize(size);
+        return m_output.data();
+    }, [this](size_t size, size_t used) {
+        //Either side may end the connection after this message
+        if(icontains(std::string_view(m_output.data(), used), "connection: close"))
+            m_failed = true;
+        return true;
+    });
+    if(!direction.process(data + direct, size - direct, output))
+        m_failed = true;
+}
+
+void upstream_connection::fail() {
+    m_failed = true;
+}
+
+bool upstream_connection::reusable() const {
+    return !m_failed && m_pending->empty() && m_requests.between_messages() && m_responses.between_messages();
+}
+
+const std::string & upstream_connection::host() const {
+    return m_host;
+}
+
+uint16_t upstream_connection::port() const {
+    return m_port;
+}
+
+upstream_pool::upstream_pool(socketmultiplex * mx, size_t max_per_target):
+    m_mx{mx},
+    m_max_per_target{max_per_target} {
+}
+
+upstream_pool::~upstream_pool() {
+    for(auto& target: m_targets) {
+        for(auto& connection: target.second)
+            m_mx->remove_socket_callback(connection.socket);
+    }
+}
+
+static std::string make_key(const std::string & host, uint16_t port) {
+    return host + std::string(":") + std::to_string(port);
+}
+
+//Still connected and nothing unexpected waiting?
+static bool alive(int socket) {
+    char c;
+    ssize_t n = recv(socket, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+}
+
+// Most recently used idle connection to host:port, or -1. The caller takes over the socket
+// and registers its own callback for it.
+int upstream_pool::take(const std::string & host, uint16_t port) {
+    auto target = m_targets.find(make_key(host, port));
+    if(target == m_targets.end())
+        return -1;
+    time_t now = time(nullptr);
+    while(!target->second.empty()) {
+        idle_connection connection = target->second.back();
+        target->second.pop_back();
+        m_idle --;
+        if((now - connection.since < UPSTREAM_IDLE_TIMEOUT) && alive(connection.socket)) {
+            m_stats.reuses ++;
+            return connection.socket;
+        }
+        drop(connection.socket);
+    }
+    return -1;
+}
+
+// Socket of a closed channel. Kept if its HTTP state allows, closed otherwise.
+void upstream_pool::give(const upstream_connection & connection, int socket) {
+    if(!connection.reusable() || (m_max_per_target == 0) || (m_idle >= UPSTREAM_POOL_MAX)) {
+        m_mx->remove_socket_callback(socket);
+        return;
+    }
+    std::string key = make_key(connection.host(), connection.port());
+    auto& idle = m_targets[key];
+    if(idle.size() >= m_max_per_target) {
+        drop(idle.front().socket);
+        idle.pop_front();
+        m_idle --;
+    }
+    debugprintf("Keep connection %d to %s", socket, key.data());
+    idle.push_back(idle_connection{socket, time(nullptr)});
+    m_idle ++;
+    m_stats.kept ++;
+    m_mx->register_socket_callback(socket, [this, key](int socket) {
+        //Server closed it, or sends something nobody asked for
+        debugprintf("Idle connection %d to %s gone", socket, key.data());
+        forget(key, socket);
+        m_stats.dropped ++;
+        return false;
+    });
+}
+
+void upstream_pool::connected() {
+    m_stats.connects ++;
+}
+
+// Called now and then from the event loop
+void upstream_pool::expire() {
+    time_t now = time(nullptr);
+    for(auto target = m_targets.begin(); target != m_targets.end();) {
+        auto& idle = target->second;
+        while(!idle.empty() && (now - idle.front().since >= UPSTREAM_IDLE_TIMEOUT)) {
+            drop(idle.front().socket);
+            idle.pop_front();
+            m_idle --;
+        }
+        if(idle.empty())
+            target = m_targets.erase(target);
+        else
+            target ++;
+    }
+}
+
+size_t upstream_pool::idle() const {
+    return m_idle;
+}
+
+const upstream_stats & upstream_pool::stats() const {
+    return m_stats;
+}
+
+void upstream_pool::report() const {
+    size_t channels = m_stats.connects + m_stats.reuses;
+    fprintf(stderr, "UPSTREAM %ld channels, %ld reused connections (%ld%%), %ld idle, %ld dropped\n", channels,
+            m_stats.reuses, (channels > 0) ? (m_stats.reuses * 100) / channels : 0, m_idle, m_stats.dropped);
+}
+
+void upstream_pool::drop(int socket) {
+    m_stats.dropped ++;
+    m_mx->remove_socket_callback(socket);
+}
+
+void upstream_pool::forget(const std::string & key, int socket) {
+    auto target = m_targets.find(key);
+    if(target == m_targets.end())
+        return;
+    for(auto connection = target->second.begin(); connection != target->second.end(); connection ++) {
+        if(connection->socket == socket) {
+            target->second.erase(connection);
+            m_idle --;
+            return;
+        }
+    }
+}
@@ -0,0 +1,95 @@
+/*
+ * dlnatunnel
+ * Copyright (C) 2023 Stefan Wildemann
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __UPSTREAM_POOL_H
+#define __UPSTREAM_POOL_H
+#include <stdint.h>
+#include <time.h>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include "socketmultiplex.h"
+#include "http.h"
+
+//Idle connections of all media servers together
+#define UPSTREAM_POOL_MAX 32
+//Seconds an idle connection is kept. Servers close theirs after 15s and more.
+#define UPSTREAM_IDLE_TIMEOUT 10
+
+/* HTTP state of a connection to a media server, in both directions. It may be reused once
+ * every request got its complete response and neither side asked to close it. */
+class upstream_connection {
+public:
+    upstream_connection(const std::string & host, uint16_t port);
+
+    void request(const char * data, size_t size);
+    void response(const char * data, size_t size);
+    void fail();
+    bool reusable() const;
+    const std::string & host() const;
+    uint16_t port() const;
+private:
+    void track(http & direction, const char * data, size_t size);
+    std::string m_host;
+    uint16_t m_port;
+    std::shared_ptr<http_requests> m_pending;
+    http m_requests;
+    http m_responses;
+    std::string m_output{}; //parser output, only looked at
+    bool m_failed{false};
+};
+
+struct upstream_stats {
+    size_t connects{0}; //channels that needed a new connection
+    size_t reuses{0}; //channels that got an idle one
+    size_t kept{0}; //connections put back after their channel
+    size_t dropped{0}; //idle connections closed: by the server, too old or no room
+};
+
+/* Connections to media servers whose channel is closed, kept for the next channel to the same
+ * server. Saves a TCP handshake for each of the many short requests of a client loading
+ * thumbnails. Idle connections are dropped as soon as the server closes them or sends anything,
+ * once they are too old, and when there are too many. Lives in one socketmultiplex, shared by
+ * the tunnels running there. */
+class upstream_pool {
+public:
+    upstream_pool(socketmultiplex * mx, size_t max_per_target);
+    ~upstream_pool();
+
+    int take(const std::string & host, uint16_t port);
+    void give(const upstream_connection & connection, int socket);
+    void connected();
+    void expire();
+    size_t idle() const;
+    const upstream_stats & stats() const;
+    void report() const;
+private:
+    struct idle_connection {
+        int socket{-1};
+        time_t since{0};
+    };
+    void drop(int socket);
+    void forget(const std::string & key, int socket);
+    socketmultiplex * m_mx;
+    size_t m_max_per_target;
+    size_t m_idle{0};
+    std::map<std::string, std::deque<idle_connection>> m_targets{};
+    upstream_stats m_stats{};
+};
+
+#endif